@@ -0,0 +1,203 @@
+#ifndef JAGUAR_BITMAP_H
+#define JAGUAR_BITMAP_H
+
+/*
+ * Bitmap engine, shared by the kernel module and mkfs.
+ *
+ * Bitmaps on disk are MSB first, ie bit 0 is the 0x80 bit of byte 0.
+ * Loading 8 bytes as a big endian word puts bit 0 at the top of the
+ * word, so all scans below work 64 bits at a time using clz/popcount.
+ */
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/string.h>
+#include <linux/bitops.h>
+#include <asm/byteorder.h>
+
+#define jaguar_clz64(w)		(64 - fls64(w))
+#define jaguar_popcount64(w)	hweight64(w)
+#else
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+typedef uint64_t u64;
+
+#define be64_to_cpu(w)		be64toh(w)
+#define jaguar_clz64(w)		__builtin_clzll(w)
+#define jaguar_popcount64(w)	__builtin_popcountll(w)
+#endif
+
+#define JAGUAR_BITS_PER_WORD	64
+
+/* load 64 bits starting at word index 'word'.
+ * bytes beyond the end of the bitmap read as all 1s (ie, in use), so
+ * that a partial last word never yields a free bit.
+ */
+static inline u64 jaguar_bmap_word(const void *bmap, int nbits, int word)
+{
+	const unsigned char *p = (const unsigned char *)bmap + word * 8;
+	int i, nbytes = (nbits + 7) / 8 - word * 8;
+	u64 w;
+
+	if (nbytes >= 8) {
+		memcpy(&w, p, sizeof(w));
+		return be64_to_cpu(w);
+	}
+
+	w = 0;
+	for (i = 0; i < 8; i++)
+		w = (w << 8) | (i < nbytes ? p[i] : 0xFF);
+
+	return w;
+}
+
+static inline int jaguar_test_bit(const void *bmap, int pos)
+{
+	return (((const unsigned char *)bmap)[pos / 8] & (0x80 >> (pos % 8))) != 0;
+}
+
+static inline void jaguar_set_bit(void *bmap, int pos)
+{
+	((unsigned char *)bmap)[pos / 8] |= 0x80 >> (pos % 8);
+}
+
+static inline void jaguar_clear_bit(void *bmap, int pos)
+{
+	((unsigned char *)bmap)[pos / 8] &= ~(0x80 >> (pos % 8));
+}
+
+/* set/clear 'len' bits starting at 'start'.
+ * partial bytes at either end are done bit by bit, the rest by memset.
+ */
+static inline void jaguar_fill_bits(void *bmap, int start, int len, int set)
+{
+	unsigned char *p = (unsigned char *)bmap;
+	int end = start + len;
+
+	while (start < end && (start % 8)) {
+		if (set)
+			jaguar_set_bit(bmap, start);
+		else
+			jaguar_clear_bit(bmap, start);
+		start++;
+	}
+
+	if (end - start >= 8) {
+		memset(p + start / 8, set ? 0xFF : 0, (end - start) / 8);
+		start += (end - start) / 8 * 8;
+	}
+
+	while (start < end) {
+		if (set)
+			jaguar_set_bit(bmap, start);
+		else
+			jaguar_clear_bit(bmap, start);
+		start++;
+	}
+}
+
+static inline void jaguar_set_bits(void *bmap, int start, int len)
+{
+	jaguar_fill_bits(bmap, start, len, 1);
+}
+
+static inline void jaguar_clear_bits(void *bmap, int start, int len)
+{
+	jaguar_fill_bits(bmap, start, len, 0);
+}
+
+/* find the first bit at or after 'offset' whose value is 'set'.
+ * returns the bit position, or -1 if there is none below 'nbits'.
+ */
+static inline int __jaguar_find_next_bit(const void *bmap, int nbits,
+	int offset, int set)
+{
+	int word, bit;
+	u64 w;
+
+	if (offset >= nbits)
+		return -1;
+
+	word = offset / JAGUAR_BITS_PER_WORD;
+
+	/* in the first word, hide the bits before 'offset' */
+	w = jaguar_bmap_word(bmap, nbits, word);
+	if (set)
+		w = ~w;
+	w |= ~(~0ULL >> (offset % JAGUAR_BITS_PER_WORD));
+
+	while (w == ~0ULL) {
+		word++;
+		if (word * JAGUAR_BITS_PER_WORD >= nbits)
+			return -1;
+		w = jaguar_bmap_word(bmap, nbits, word);
+		if (set)
+			w = ~w;
+	}
+
+	bit = word * JAGUAR_BITS_PER_WORD + jaguar_clz64(~w);
+
+	return bit < nbits ? bit : -1;
+}
+
+static inline int jaguar_find_next_zero_bit(const void *bmap, int nbits, int offset)
+{
+	return __jaguar_find_next_bit(bmap, nbits, offset, 0);
+}
+
+static inline int jaguar_find_next_set_bit(const void *bmap, int nbits, int offset)
+{
+	return __jaguar_find_next_bit(bmap, nbits, offset, 1);
+}
+
+static inline int jaguar_find_first_zero_bit(const void *bmap, int nbits)
+{
+	return jaguar_find_next_zero_bit(bmap, nbits, 0);
+}
+
+/* find a run of at least 'len' zero bits at or after 'offset'.
+ * returns the start of the run, or -1 if there is no such run.
+ */
+static inline int jaguar_find_zero_run(const void *bmap, int nbits,
+	int offset, int len)
+{
+	int start, end;
+
+	start = jaguar_find_next_zero_bit(bmap, nbits, offset);
+	while (start >= 0) {
+		end = jaguar_find_next_set_bit(bmap, nbits, start);
+		if (end < 0)
+			end = nbits;
+
+		if (end - start >= len)
+			return start;
+
+		start = jaguar_find_next_zero_bit(bmap, nbits, end);
+	}
+
+	return -1;
+}
+
+/* number of set bits in the first 'nbits' bits */
+static inline int jaguar_bitmap_weight(const void *bmap, int nbits)
+{
+	int word, nwords, weight = 0;
+	u64 w;
+
+	nwords = (nbits + JAGUAR_BITS_PER_WORD - 1) / JAGUAR_BITS_PER_WORD;
+	for (word = 0; word < nwords; word++) {
+		w = jaguar_bmap_word(bmap, nbits, word);
+
+		/* ignore the padding beyond nbits in the last word */
+		if ((word + 1) * JAGUAR_BITS_PER_WORD > nbits)
+			w &= ~(~0ULL >> (nbits % JAGUAR_BITS_PER_WORD));
+
+		weight += jaguar_popcount64(w);
+	}
+
+	return weight;
+}
+
+#endif // JAGUAR_BITMAP_H
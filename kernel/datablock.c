@@ -1,76 +1,398 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
 #include "jaguar.h"
 #include "debug.h"
 
-int alloc_data_block(struct super_block *sb)
+/* blocks that can still be allocated, not counting the ones reserved
+ * by delayed allocation. the blocks in preallocation windows are free
+ * on disk and count, as the windows are given back when the disk runs
+ * out of space.
+ */
+static int blocks_available(struct jaguar_super_block *jsb)
 {
-	int ret = -1, blknum, start;
-	int bmap_start, bmap_size;
-	struct jaguar_super_block *jsb;
-	struct jaguar_super_block_on_disk *jsbd;
-	struct buffer_head *bh = NULL;
+	int n;
 
-	jsb = sb->s_fs_info;
-	jsbd = jsb->disk_copy;
+	spin_lock(&jsb->lock);
+	n = jsb->disk_copy->n_blocks_free - jsb->n_blocks_reserved;
+	spin_unlock(&jsb->lock);
 
-	if (jsbd->n_blocks_free == 0) {
+	return n;
+}
+
+/* allocate a contiguous run of at least 'min' and at most 'max' data
+ * blocks, starting at or near 'goal'. if goal is 0, the search starts
+ * in the group preferred by the current cpu. 'reserved' of the blocks
+ * are covered by the caller's delayed allocation reservations, the
+ * rest must come from space nobody has reserved. if 'ji' is given, up
+ * to 'pa_max' more blocks become its preallocation window.
+ * returns the first block of the run, and the run length in 'count'.
+ * note: the blocks are NOT zeroed.
+ */
+static int __alloc_data_blocks(struct super_block *sb, int goal, int min,
+	int max, int *count, int reserved, struct jaguar_inode *ji, int pa_max)
+{
+	int ret = -1, blknum;
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+
+	if (blocks_available(jsb) < min - reserved) {
 		ERR("no more blocks available\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
 
-	bmap_start = BYTES_TO_BLOCK(jsbd->data_bmap_start);
-	bmap_size = BYTES_TO_BLOCK(jsbd->data_bmap_size);
-	start = (jsbd->next_free_block / NUM_BITS_PER_BLOCK);
-
-	/* allocate a data block from the bitmap */
-	blknum = jaguar_bmap_alloc_bit(sb->s_bdev, 
-			bmap_start, bmap_size, start);
+	/* allocate the data blocks from the group bitmaps */
+	blknum = jaguar_group_alloc_blocks(sb, goal, min, max, count, ji, pa_max);
 	if (blknum < 0) {
-		ERR("could not alloc data block\n");
+		ERR("could not alloc data blocks\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
-	DBG("alloc_data_block: found blknum %d\n", blknum);
+	DBG("alloc_data_blocks: found blknum %d, count %d\n", blknum, *count);
 
-	/* update super block info */
-	jsbd->n_blocks_free--;
-	jsbd->next_free_block = (blknum + 1) % jsbd->n_blocks;
-	mark_buffer_dirty(jsb->bh);
+	ret = blknum;
 
-	/* zero out the allocated block */
-	if ((bh = __getblk(sb->s_bdev, blknum, JAGUAR_BLOCK_SIZE)) == NULL) {
-		ERR("error reading data blk from disk\n");
-		ret = -EIO;
+fail:
+	return ret;
+}
+
+int alloc_data_blocks(struct super_block *sb, int goal, int min, int max,
+	int *count)
+{
+	return __alloc_data_blocks(sb, goal, min, max, count, 0, NULL, 0);
+}
+
+/* zero out 'count' data blocks starting at 'block' */
+int zero_data_blocks(struct super_block *sb, int block, int count)
+{
+	struct buffer_head *bh;
+
+	while (count--) {
+		if ((bh = __getblk(sb->s_bdev, block, JAGUAR_BLOCK_SIZE)) == NULL) {
+			ERR("error reading data blk from disk\n");
+			return -EIO;
+		}
+		set_buffer_uptodate(bh);
+		memset(bh->b_data, 0, JAGUAR_BLOCK_SIZE);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+		block++;
+	}
+
+	return 0;
+}
+
+/* reserve space for 'count' blocks without allocating them.
+ * used by delayed allocation, so that a write that got through
+ * write_begin can always be placed at writeback.
+ */
+int reserve_data_blocks(struct super_block *sb, int count)
+{
+	int ret = 0;
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+
+	spin_lock(&jsb->lock);
+	if (jsb->disk_copy->n_blocks_free - jsb->n_blocks_reserved < count) {
+		DBG("reserve_data_blocks: no space for %d blocks\n", count);
+		ret = -ENOSPC;
+	} else
+		jsb->n_blocks_reserved += count;
+	spin_unlock(&jsb->lock);
+
+	return ret;
+}
+
+void release_data_blocks(struct super_block *sb, int count)
+{
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+
+	spin_lock(&jsb->lock);
+	jsb->n_blocks_reserved -= count;
+	if (WARN_ON(jsb->n_blocks_reserved < 0))
+		jsb->n_blocks_reserved = 0;
+	spin_unlock(&jsb->lock);
+}
+
+/* reserve a delayed block of inode 'i', along with the map blocks that
+ * placing it may need in the worst case.
+ */
+int reserve_delayed_block(struct inode *i)
+{
+	int ret;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+
+	if ((ret = reserve_data_blocks(i->i_sb, 1 + JAGUAR_DA_META_BLOCKS)))
+		return ret;
+
+	ji->n_reserved++;
+	ji->n_meta_reserved += JAGUAR_DA_META_BLOCKS;
+
+	return 0;
+}
+
+/* 'count' delayed blocks of inode 'i' were placed, or dropped. the map
+ * blocks reserved beyond what its other delayed blocks may still need
+ * are given back too.
+ */
+void release_delayed_blocks(struct inode *i, int count)
+{
+	int extra;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+
+	ji->n_reserved -= count;
+	extra = ji->n_meta_reserved - ji->n_reserved * JAGUAR_DA_META_BLOCKS;
+	if (extra > 0) {
+		ji->n_meta_reserved -= extra;
+		count += extra;
+	}
+
+	release_data_blocks(i->i_sb, count);
+}
+
+/* allocate a single zeroed data block near 'goal'. the preallocation
+ * windows are given back if the disk looks full.
+ */
+static int __alloc_data_block(struct super_block *sb, int goal, int reserved)
+{
+	int ret, blknum, count;
+
+	blknum = __alloc_data_blocks(sb, goal, 1, 1, &count, reserved, NULL, 0);
+	if (blknum < 0) {
+		discard_all_prealloc(sb);
+		blknum = __alloc_data_blocks(sb, goal, 1, 1, &count, reserved,
+				NULL, 0);
+	}
+	if (blknum < 0) {
+		ret = blknum;
 		goto fail;
 	}
-	set_buffer_uptodate(bh);
-	memset(bh->b_data, 0, JAGUAR_BLOCK_SIZE);
-	mark_buffer_dirty(bh);
+
+	/* zero out the allocated block */
+	if ((ret = zero_data_blocks(sb, blknum, 1)) < 0)
+		goto fail;
 
 	ret = blknum;
 
 fail:
-	if (bh)
-		brelse(bh);
 	return ret;
 }
 
-int free_data_block(struct super_block *sb, int block_to_free)
+int alloc_data_block(struct super_block *sb, int goal)
 {
-	int ret = 0;
-	int bmap_start;
-	struct jaguar_super_block *jsb;
-	struct jaguar_super_block_on_disk *jsbd;
+	return __alloc_data_block(sb, goal, 0);
+}
+
+/* allocate a block for the block map of inode 'i'. while the inode
+ * has delayed blocks, it comes out of the map blocks reserved for them.
+ */
+int alloc_map_block(struct inode *i, int goal)
+{
+	int block;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+
+	if (!ji->n_meta_reserved)
+		return __alloc_data_block(i->i_sb, goal, 0);
 
-	jsb = sb->s_fs_info;
-	jsbd = jsb->disk_copy;
+	if ((block = __alloc_data_block(i->i_sb, goal, 1)) >= 0) {
+		ji->n_meta_reserved--;
+		release_data_blocks(i->i_sb, 1);
+	}
 
-	bmap_start = BYTES_TO_BLOCK(jsbd->data_bmap_start);
+	return block;
+}
 
-	/* update the data bitmap */
-	ret = jaguar_bmap_free_bit(sb->s_bdev, bmap_start, block_to_free);
+static int cmp_block(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+void free_batch_init(struct jaguar_free_batch *fb, struct super_block *sb)
+{
+	fb->sb = sb;
+	fb->n = 0;
+	fb->ret = 0;
+	fb->blocks = kmalloc(JAGUAR_FREE_BATCH_MAX * sizeof(int), GFP_NOFS);
+}
+
+/* free all blocks collected so far, in block order */
+static void free_batch_flush(struct jaguar_free_batch *fb)
+{
+	int ret;
+
+	if (fb->n == 0)
+		return;
+
+	sort(fb->blocks, fb->n, sizeof(int), cmp_block, NULL);
+	ret = jaguar_group_free_blocks(fb->sb, fb->blocks, fb->n);
+	if (ret && !fb->ret)
+		fb->ret = ret;
+	DBG("free_batch_flush: freed %d blks from %d\n", fb->n, fb->blocks[0]);
+
+	fb->n = 0;
+}
+
+/* add a block to the batch. the batch is flushed when it fills up. if
+ * there was no memory for a batch, the block is freed right away.
+ */
+int free_batch_add(struct jaguar_free_batch *fb, int block)
+{
+	if (!fb->blocks)
+		return free_data_block(fb->sb, block);
+
+	fb->blocks[fb->n++] = block;
+	if (fb->n == JAGUAR_FREE_BATCH_MAX)
+		free_batch_flush(fb);
+
+	return 0;
+}
+
+/* free the rest of the batch. returns the first error seen */
+int free_batch_finish(struct jaguar_free_batch *fb)
+{
+	if (fb->blocks) {
+		free_batch_flush(fb);
+		kfree(fb->blocks);
+		fb->blocks = NULL;
+	}
+
+	return fb->ret;
+}
+
+/* allocate a run of up to 'max' data blocks for inode 'i' near 'goal'.
+ * an inode that keeps allocating at the end of its last run is served
+ * from its preallocation window. otherwise up to JAGUAR_PREALLOC_BLOCKS
+ * free blocks after the run become the new window. this keeps files
+ * that are appended to concurrently from interleaving their blocks on
+ * disk.
+ * a window lives only in memory. the group allocator passes over it,
+ * but its blocks stay free in the bitmap, so nothing leaks if the fs
+ * is not unmounted cleanly.
+ * 'reserved' of the 'max' blocks are covered by reservations the
+ * caller holds.
+ * note: the blocks are NOT zeroed.
+ */
+int alloc_inode_data_blocks(struct inode *i, int goal, int max, int *count,
+	int reserved)
+{
+	int ret, n;
+	struct super_block *sb = i->i_sb;
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+
+	/* blocks from the window count as free too, so they are held
+	 * to the same limit.
+	 */
+	n = blocks_available(jsb) + reserved;
+	if (n < 1) {
+		DBG("alloc_inode_data_blocks: no unreserved space\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+	max = min(max, n);
+
+	if ((ret = jaguar_group_take_window(sb, ji, goal, max, count)))
+		goto out;
+
+	/* the inode is allocating somewhere else, the window is stale */
+	discard_prealloc(i);
+
+	ret = __alloc_data_blocks(sb, goal, 1, max, count, reserved, ji,
+			JAGUAR_PREALLOC_BLOCKS);
+	if (ret < 0) {
+		/* the space might be sitting in other inodes' windows */
+		discard_all_prealloc(sb);
+		ret = __alloc_data_blocks(sb, goal, 1, max, count, reserved,
+				NULL, 0);
+	}
+
+out:
+	return ret;
+}
+
+/* drop the window of 'ji'. called under jsb->lock. */
+static void drop_window(struct jaguar_super_block *jsb, struct jaguar_inode *ji)
+{
+	DBG("drop_window: window %d-%d\n", ji->pa_start,
+		ji->pa_start + ji->pa_len - 1);
+
+	jsb->groups[BLOCK_TO_GROUP(ji->pa_start)].n_prealloc -= ji->pa_len;
+	jsb->n_blocks_prealloc -= ji->pa_len;
+	jsb->n_prealloc_inodes--;
+	ji->pa_len = 0;
+	list_del_init(&ji->pa_list);
+	list_del_init(&ji->pa_group_list);
+}
+
+/* give the unused blocks of an inode's preallocation window back to
+ * the allocator. they were never taken from the bitmap.
+ */
+void discard_prealloc(struct inode *i)
+{
+	struct jaguar_super_block *jsb = i->i_sb->s_fs_info;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+
+	spin_lock(&jsb->lock);
+	if (ji->pa_len)
+		drop_window(jsb, ji);
+	spin_unlock(&jsb->lock);
+}
+
+/* drop the windows of all inodes, when the disk is running out of
+ * space, and at unmount.
+ */
+void discard_all_prealloc(struct super_block *sb)
+{
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+
+	spin_lock(&jsb->lock);
+	while (!list_empty(&jsb->prealloc_inodes))
+		drop_window(jsb, list_first_entry(&jsb->prealloc_inodes,
+				struct jaguar_inode, pa_list));
+	spin_unlock(&jsb->lock);
+}
+
+/* under memory pressure, drop the windows that were opened longest ago,
+ * 'nr_to_scan' of them. returns the num of windows left.
+ */
+static int prealloc_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	int n, nr = sc->nr_to_scan;
+	struct jaguar_super_block *jsb =
+		container_of(s, struct jaguar_super_block, pa_shrinker);
+
+	spin_lock(&jsb->lock);
+	while (nr-- > 0 && !list_empty(&jsb->prealloc_inodes))
+		drop_window(jsb, list_first_entry(&jsb->prealloc_inodes,
+				struct jaguar_inode, pa_list));
+	n = jsb->n_prealloc_inodes;
+	spin_unlock(&jsb->lock);
+
+	return n;
+}
+
+void jaguar_prealloc_register(struct super_block *sb)
+{
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+
+	jsb->pa_shrinker.shrink = prealloc_shrink;
+	jsb->pa_shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&jsb->pa_shrinker);
+}
+
+void jaguar_prealloc_unregister(struct super_block *sb)
+{
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+
+	unregister_shrinker(&jsb->pa_shrinker);
+}
+
+int free_data_block(struct super_block *sb, int block_to_free)
+{
+	int ret = 0;
+
+	/* update the data bitmap and group counters */
+	ret = jaguar_group_free_block(sb, block_to_free);
 	if (ret < 0) {
 		ERR("error updating data bitmap\n");
 		ret = -EIO;
@@ -79,10 +401,6 @@ int free_data_block(struct super_block *sb, int block_to_free)
 
 	DBG("free_data_block: freed blk %d\n", block_to_free);
 
-	/* update super block info */
-	jsbd->n_blocks_free++;
-	mark_buffer_dirty(jsb->bh);
-
 fail:
 	return ret;
 
@@ -0,0 +1,473 @@
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include "jaguar.h"
+#include "debug.h"
+
+/*
+ * Directory index.
+ *
+ * The dentries of a dir stay where they are, so readdir, versioning and
+ * rollback of dirs work as before. The index maps the hash of a name to
+ * the slots of the dentries with that hash. A lookup reads the root, a
+ * bucket block or two and the dentry block, instead of the whole dir.
+ *
+ * The index can always be rebuilt from the dentries. If it cannot be
+ * updated, it is dropped, and the dir is scanned as before until it is
+ * built again by the next create.
+ *
+ * All callers hold the i_mutex of the dir.
+ */
+
+/* FNV-1a. it is on disk, so it must never change */
+static unsigned int dx_hash(const char *name)
+{
+	unsigned int h = 2166136261U;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+/* get a zeroed index block */
+static struct buffer_head *dx_new_block(struct inode *dir)
+{
+	int block;
+	struct buffer_head *bh;
+	struct jaguar_inode *ji = (struct jaguar_inode *)dir->i_private;
+
+	if ((block = alloc_data_block(dir->i_sb, ji->last_block)) < 0) {
+		ERR("could not allocate dir index block\n");
+		return NULL;
+	}
+
+	if ((bh = __getblk(dir->i_sb->s_bdev, block, JAGUAR_BLOCK_SIZE)) == NULL) {
+		ERR("could not get buffer head for dir index block\n");
+		free_data_block(dir->i_sb, block);
+		return NULL;
+	}
+
+	set_buffer_uptodate(bh);
+	memset(bh->b_data, 0, JAGUAR_BLOCK_SIZE);
+	mark_buffer_dirty(bh);
+
+	return bh;
+}
+
+static struct buffer_head *dx_read_root(struct super_block *sb, int block)
+{
+	struct buffer_head *bh;
+
+	if ((bh = __bread(sb->s_bdev, block, JAGUAR_BLOCK_SIZE)) == NULL) {
+		ERR("could not read dir index root\n");
+		return NULL;
+	}
+
+	if (((struct jaguar_dx_root *)bh->b_data)->magic != JAGUAR_DX_MAGIC) {
+		ERR("corrupt dir index root %d\n", block);
+		brelse(bh);
+		return NULL;
+	}
+
+	return bh;
+}
+
+/* add an entry to bucket 'b'. only the first block of a chain takes new
+ * entries. when it is full, a new block is put in front of it.
+ * the caller marks the root dirty.
+ */
+static int dx_insert(struct inode *dir, struct jaguar_dx_root *root, int b,
+	unsigned int hash, int slot)
+{
+	struct buffer_head *bh = NULL;
+	struct jaguar_dx_bucket *bucket = NULL;
+
+	if (root->bucket[b]) {
+		if ((bh = __bread(dir->i_sb->s_bdev, root->bucket[b],
+				JAGUAR_BLOCK_SIZE)) == NULL) {
+			ERR("could not read dir index bucket\n");
+			return -EIO;
+		}
+		bucket = (struct jaguar_dx_bucket *)bh->b_data;
+		if (bucket->count == JAGUAR_DX_PER_BUCKET) {
+			brelse(bh);
+			bh = NULL;
+		}
+	}
+
+	if (bh == NULL) {
+		if ((bh = dx_new_block(dir)) == NULL)
+			return -ENOSPC;
+		bucket = (struct jaguar_dx_bucket *)bh->b_data;
+		bucket->next = root->bucket[b];
+		root->bucket[b] = bh->b_blocknr;
+	}
+
+	bucket->entry[bucket->count].hash = hash;
+	bucket->entry[bucket->count].slot = slot;
+	bucket->count++;
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	return 0;
+}
+
+/* double the num of buckets. the entries of bucket b are split between
+ * buckets b and b + n, into new chains. the old chains are freed.
+ */
+static int dx_grow(struct inode *dir, struct jaguar_dx_root *root)
+{
+	int b, k, n = root->nbuckets, ret = 0;
+	unsigned int block, next;
+	struct buffer_head *bh;
+	struct jaguar_dx_bucket *bucket;
+	struct jaguar_dx_entry *e;
+	struct jaguar_free_batch fb;
+
+	DBG("dx_grow: inum=%d, %d buckets, %d entries\n",
+		(int)dir->i_ino, n, root->count);
+
+	free_batch_init(&fb, dir->i_sb);
+
+	for (b = 0; b < n && !ret; b++) {
+		block = root->bucket[b];
+		root->bucket[b] = 0;
+
+		while (block && !ret) {
+			if ((bh = __bread(dir->i_sb->s_bdev, block,
+					JAGUAR_BLOCK_SIZE)) == NULL) {
+				ERR("could not read dir index bucket\n");
+				ret = -EIO;
+				break;
+			}
+			bucket = (struct jaguar_dx_bucket *)bh->b_data;
+
+			for (k = 0; k < bucket->count && !ret; k++) {
+				e = &bucket->entry[k];
+				ret = dx_insert(dir, root, e->hash & (2 * n - 1),
+					e->hash, e->slot);
+			}
+
+			next = bucket->next;
+			brelse(bh);
+			free_batch_add(&fb, block);
+			block = next;
+		}
+	}
+
+	root->nbuckets = 2 * n;
+
+	if (free_batch_finish(&fb) && !ret)
+		ret = -EIO;
+
+	return ret;
+}
+
+/* build the index of a dir from its dentries */
+int jaguar_dx_build(struct inode *dir)
+{
+	int ret = 0, logical, block, k, slot, nslots;
+	unsigned int hash;
+	struct jaguar_inode *ji = (struct jaguar_inode *)dir->i_private;
+	struct buffer_head *root_bh, *bh;
+	struct jaguar_dx_root *root;
+	struct jaguar_dentry_on_disk *jd;
+
+	nslots = dir->i_size / sizeof(*jd);
+
+	DBG("jaguar_dx_build: entering, inum=%d, slots=%d\n",
+		(int)dir->i_ino, nslots);
+
+	if ((root_bh = dx_new_block(dir)) == NULL)
+		return -ENOSPC;
+
+	/* a bucket is about half full after the build */
+	root = (struct jaguar_dx_root *)root_bh->b_data;
+	root->magic = JAGUAR_DX_MAGIC;
+	root->nbuckets = 1;
+	while (root->nbuckets < JAGUAR_DX_MAX_BUCKETS &&
+	       root->nbuckets * (JAGUAR_DX_PER_BUCKET / 2) < nslots)
+		root->nbuckets *= 2;
+
+	ji->disk_copy.dir_index = root_bh->b_blocknr;
+	mark_inode_dirty(dir);
+
+	for (logical = 0; logical * JAGUAR_DENTRIES_PER_BLOCK < nslots; logical++) {
+		if ((block = logical_to_phys_block(dir, logical)) == 0)
+			continue;
+
+		if ((bh = __bread(dir->i_sb->s_bdev, block, JAGUAR_BLOCK_SIZE)) == NULL) {
+			ERR("could not read dir block\n");
+			ret = -EIO;
+			break;
+		}
+		jd = (struct jaguar_dentry_on_disk *)bh->b_data;
+
+		slot = logical * JAGUAR_DENTRIES_PER_BLOCK;
+		for (k = 0; k < JAGUAR_DENTRIES_PER_BLOCK && slot < nslots; k++, slot++) {
+			if (jd[k].inum == 0)
+				continue;
+			hash = dx_hash(jd[k].name);
+			if ((ret = dx_insert(dir, root, hash & (root->nbuckets - 1),
+					hash, slot)))
+				break;
+			root->count++;
+		}
+
+		brelse(bh);
+		if (ret)
+			break;
+	}
+
+	mark_buffer_dirty(root_bh);
+	brelse(root_bh);
+
+	if (ret) {
+		ERR("could not build index of dir %d, err=%d\n", (int)dir->i_ino, ret);
+		jaguar_dx_drop(dir);
+	}
+
+	return ret;
+}
+
+/* look up a name in the index. returns its inum, with its slot in
+ * 'slot', 0 if it is not there, or a negative error.
+ */
+int jaguar_dx_lookup(struct inode *dir, const char *name, int *slot)
+{
+	int ret = 0, logical, last = -1, block, k;
+	unsigned int hash = dx_hash(name), next;
+	struct jaguar_inode *ji = (struct jaguar_inode *)dir->i_private;
+	struct buffer_head *root_bh, *bh = NULL, *dbh = NULL;
+	struct jaguar_dx_root *root;
+	struct jaguar_dx_bucket *bucket;
+	struct jaguar_dentry_on_disk *jd;
+
+	if ((root_bh = dx_read_root(dir->i_sb, ji->disk_copy.dir_index)) == NULL)
+		return -EIO;
+	root = (struct jaguar_dx_root *)root_bh->b_data;
+	next = root->bucket[hash & (root->nbuckets - 1)];
+	brelse(root_bh);
+
+	while (next && ret == 0) {
+		if ((bh = __bread(dir->i_sb->s_bdev, next, JAGUAR_BLOCK_SIZE)) == NULL) {
+			ERR("could not read dir index bucket\n");
+			ret = -EIO;
+			break;
+		}
+		bucket = (struct jaguar_dx_bucket *)bh->b_data;
+
+		for (k = 0; k < bucket->count; k++) {
+			if (bucket->entry[k].hash != hash)
+				continue;
+
+			/* same hash, compare the name in the dentry */
+			logical = bucket->entry[k].slot / JAGUAR_DENTRIES_PER_BLOCK;
+			if (logical != last) {
+				if (dbh)
+					brelse(dbh);
+				dbh = NULL;
+				last = logical;
+				if ((block = logical_to_phys_block(dir, logical)) == 0)
+					continue;
+				if ((dbh = __bread(dir->i_sb->s_bdev, block,
+						JAGUAR_BLOCK_SIZE)) == NULL) {
+					ERR("could not read dir block\n");
+					ret = -EIO;
+					break;
+				}
+			}
+			if (dbh == NULL)
+				continue;
+
+			jd = (struct jaguar_dentry_on_disk *)dbh->b_data +
+				bucket->entry[k].slot % JAGUAR_DENTRIES_PER_BLOCK;
+			if (jd->inum && strcmp(jd->name, name) == 0) {
+				*slot = bucket->entry[k].slot;
+				ret = jd->inum;
+				break;
+			}
+		}
+
+		next = bucket->next;
+		brelse(bh);
+	}
+
+	if (dbh)
+		brelse(dbh);
+
+	return ret;
+}
+
+/* a dentry was added at 'slot' */
+int jaguar_dx_add(struct inode *dir, const char *name, int slot)
+{
+	int ret = 0;
+	unsigned int hash = dx_hash(name);
+	struct jaguar_inode *ji = (struct jaguar_inode *)dir->i_private;
+	struct buffer_head *root_bh;
+	struct jaguar_dx_root *root;
+
+	if ((root_bh = dx_read_root(dir->i_sb, ji->disk_copy.dir_index)) == NULL) {
+		ret = -EIO;
+		goto fail;
+	}
+	root = (struct jaguar_dx_root *)root_bh->b_data;
+
+	if (root->nbuckets < JAGUAR_DX_MAX_BUCKETS &&
+	    root->count >= root->nbuckets * (JAGUAR_DX_PER_BUCKET / 4 * 3))
+		ret = dx_grow(dir, root);
+
+	if (!ret)
+		ret = dx_insert(dir, root, hash & (root->nbuckets - 1), hash, slot);
+	if (!ret)
+		root->count++;
+
+	mark_buffer_dirty(root_bh);
+	brelse(root_bh);
+
+fail:
+	if (ret) {
+		ERR("could not update index of dir %d, err=%d\n", (int)dir->i_ino, ret);
+		jaguar_dx_drop(dir);
+	}
+
+	return ret;
+}
+
+/* the dentry at 'slot' was removed */
+int jaguar_dx_remove(struct inode *dir, const char *name, int slot)
+{
+	int ret = 0, b, k;
+	unsigned int hash = dx_hash(name), block;
+	struct jaguar_inode *ji = (struct jaguar_inode *)dir->i_private;
+	struct buffer_head *root_bh, *bh = NULL, *prev_bh = NULL;
+	struct jaguar_dx_root *root;
+	struct jaguar_dx_bucket *bucket;
+
+	if ((root_bh = dx_read_root(dir->i_sb, ji->disk_copy.dir_index)) == NULL) {
+		ret = -EIO;
+		goto fail;
+	}
+	root = (struct jaguar_dx_root *)root_bh->b_data;
+	b = hash & (root->nbuckets - 1);
+
+	for (block = root->bucket[b]; block; block = bucket->next) {
+		if ((bh = __bread(dir->i_sb->s_bdev, block, JAGUAR_BLOCK_SIZE)) == NULL) {
+			ERR("could not read dir index bucket\n");
+			ret = -EIO;
+			goto out;
+		}
+		bucket = (struct jaguar_dx_bucket *)bh->b_data;
+
+		for (k = 0; k < bucket->count; k++) {
+			if (bucket->entry[k].hash == hash &&
+			    bucket->entry[k].slot == slot)
+				break;
+		}
+
+		if (k < bucket->count)
+			break;
+
+		if (prev_bh)
+			brelse(prev_bh);
+		prev_bh = bh;
+		bh = NULL;
+	}
+
+	if (bh == NULL) {
+		ERR("dentry slot %d not in index of dir %d\n", slot, (int)dir->i_ino);
+		ret = -ENOENT;
+		goto out;
+	}
+
+	/* the last entry of the block takes its place */
+	bucket->entry[k] = bucket->entry[--bucket->count];
+	mark_buffer_dirty(bh);
+	root->count--;
+
+	/* an empty block leaves the chain */
+	if (bucket->count == 0) {
+		if (prev_bh) {
+			((struct jaguar_dx_bucket *)prev_bh->b_data)->next = bucket->next;
+			mark_buffer_dirty(prev_bh);
+		} else {
+			root->bucket[b] = bucket->next;
+		}
+		bforget(bh);
+		bh = NULL;
+		free_data_block(dir->i_sb, block);
+	}
+	mark_buffer_dirty(root_bh);
+
+out:
+	if (bh)
+		brelse(bh);
+	if (prev_bh)
+		brelse(prev_bh);
+	brelse(root_bh);
+fail:
+	if (ret) {
+		ERR("could not update index of dir %d, err=%d\n", (int)dir->i_ino, ret);
+		jaguar_dx_drop(dir);
+	}
+
+	return ret;
+}
+
+/* free the index of a dir. lookups scan the dir till it is rebuilt */
+void jaguar_dx_drop(struct inode *dir)
+{
+	struct jaguar_inode *ji = (struct jaguar_inode *)dir->i_private;
+	struct jaguar_free_batch fb;
+
+	if (ji->disk_copy.dir_index == 0)
+		return;
+
+	DBG("jaguar_dx_drop: inum=%d\n", (int)dir->i_ino);
+
+	free_batch_init(&fb, dir->i_sb);
+	jaguar_dx_free(dir->i_sb, &ji->disk_copy, &fb);
+	free_batch_finish(&fb);
+
+	ji->disk_copy.dir_index = 0;
+	mark_inode_dirty(dir);
+}
+
+/* free all blocks of the index of an on-disk inode */
+int jaguar_dx_free(struct super_block *sb, struct jaguar_inode_on_disk *jid,
+	struct jaguar_free_batch *fb)
+{
+	int ret = 0, b;
+	unsigned int block;
+	struct buffer_head *root_bh, *bh;
+	struct jaguar_dx_root *root;
+
+	/* a corrupt root is freed, its buckets are lost */
+	if ((root_bh = dx_read_root(sb, jid->dir_index)) != NULL) {
+		root = (struct jaguar_dx_root *)root_bh->b_data;
+
+		for (b = 0; b < root->nbuckets && !ret; b++) {
+			block = root->bucket[b];
+			while (block) {
+				if ((bh = __bread(sb->s_bdev, block, JAGUAR_BLOCK_SIZE)) == NULL) {
+					ERR("could not read dir index bucket\n");
+					ret = -EIO;
+					break;
+				}
+				free_batch_add(fb, block);
+				block = ((struct jaguar_dx_bucket *)bh->b_data)->next;
+				brelse(bh);
+			}
+		}
+
+		brelse(root_bh);
+	}
+
+	free_batch_add(fb, jid->dir_index);
+
+	return ret;
+}
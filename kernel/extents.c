@@ -0,0 +1,683 @@
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include "jaguar.h"
+#include "debug.h"
+
+/*
+ * Extent based block map.
+ *
+ * A file whose blocks are contiguous is mapped by a single extent
+ * record, instead of a pointer per block. Lookups walk down the tree
+ * from the root in the inode, one extent block per level. New extents
+ * are merged into their neighbours when they continue them. A full
+ * node is split, and a full root is pushed down into a new block,
+ * growing the tree by a level.
+ */
+
+/* a node on the way from the root to a leaf */
+struct ext_path
+{
+	struct buffer_head *bh;		/* NULL for the root in the inode */
+	struct jaguar_extent_header *hdr;
+	int pos;			/* entry followed, -1 if none */
+};
+
+static inline struct jaguar_extent_header *ext_root(struct jaguar_inode_on_disk *jid)
+{
+	return (struct jaguar_extent_header *)jid->blocks;
+}
+
+static inline struct jaguar_extent *ext_entries(struct jaguar_extent_header *hdr)
+{
+	return (struct jaguar_extent *)(hdr + 1);
+}
+
+static inline struct jaguar_extent_idx *ext_index(struct jaguar_extent_header *hdr)
+{
+	return (struct jaguar_extent_idx *)(hdr + 1);
+}
+
+static inline unsigned int ext_len(struct jaguar_extent *ex)
+{
+	return ex->len & ~JAGUAR_UNWRITTEN;
+}
+
+/* set up an empty extent tree in a new inode */
+void jaguar_ext_init(struct jaguar_inode_on_disk *jid)
+{
+	struct jaguar_extent_header *hdr = ext_root(jid);
+
+	memset(jid->blocks, 0, sizeof(jid->blocks));
+	hdr->magic = JAGUAR_EXT_MAGIC;
+	hdr->max = JAGUAR_EXT_INLINE;
+	jid->flags |= INODE_FLG_EXTENTS;
+}
+
+/* index of the last entry of the node starting at or before 'logical',
+ * or -1 if there is none.
+ */
+static int ext_search(struct jaguar_extent_header *hdr, unsigned int logical)
+{
+	int lo = 0, hi = hdr->entries - 1, mid;
+	struct jaguar_extent *ex = ext_entries(hdr);
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (ex[mid].logical <= logical)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return hi;
+}
+
+static void ext_release_path(struct ext_path *path, int depth)
+{
+	for (; depth >= 0; depth--) {
+		if (path[depth].bh)
+			brelse(path[depth].bh);
+	}
+}
+
+static void ext_dirty(struct inode *i, struct ext_path *p)
+{
+	if (p->bh)
+		mark_buffer_dirty(p->bh);
+	else
+		mark_inode_dirty(i);
+}
+
+/* walk down from the root to the leaf that maps 'logical'.
+ * returns the depth of the leaf, or < 0 on error. the caller releases
+ * the path.
+ */
+static int ext_find(struct super_block *sb, struct jaguar_inode_on_disk *jid,
+	unsigned int logical, struct ext_path *path)
+{
+	int level = 0, pos, block;
+	struct jaguar_extent_header *hdr = ext_root(jid);
+	struct buffer_head *bh = NULL;
+
+	while (1) {
+		path[level].bh = bh;
+		path[level].hdr = hdr;
+
+		if (hdr->magic != JAGUAR_EXT_MAGIC || hdr->entries > hdr->max ||
+		    (level > 0 && hdr->depth != path[level - 1].hdr->depth - 1)) {
+			ERR("corrupt extent tree, level %d\n", level);
+			goto fail;
+		}
+
+		pos = ext_search(hdr, logical);
+		if (hdr->depth == 0) {
+			path[level].pos = pos;
+			break;
+		}
+
+		/* blocks before the first index entry can only go under it */
+		if (pos < 0)
+			pos = 0;
+		path[level].pos = pos;
+
+		if (hdr->entries == 0 || level + 1 >= JAGUAR_EXT_MAX_DEPTH) {
+			ERR("corrupt extent tree, level %d\n", level);
+			goto fail;
+		}
+
+		block = ext_index(hdr)[pos].block;
+		if ((bh = __bread(sb->s_bdev, block, JAGUAR_BLOCK_SIZE)) == NULL) {
+			ERR("could not read extent block %d\n", block);
+			ext_release_path(path, level);
+			return -EIO;
+		}
+		hdr = (struct jaguar_extent_header *)bh->b_data;
+		level++;
+	}
+
+	return level;
+
+fail:
+	ext_release_path(path, level);
+	return -EIO;
+}
+
+/* first logical block mapped after the leaf entry on 'path', or ~0 */
+static unsigned int ext_next_logical(struct ext_path *path, int depth)
+{
+	int level;
+
+	for (level = depth; level >= 0; level--) {
+		if (path[level].pos + 1 < path[level].hdr->entries)
+			return ext_entries(path[level].hdr)[path[level].pos + 1].logical;
+	}
+
+	return ~0U;
+}
+
+/* after the first entry of the node at 'level' changed, carry its
+ * logical block up into the index entries pointing to the node.
+ */
+static void ext_fix_keys(struct inode *i, struct ext_path *path, int level)
+{
+	unsigned int logical;
+
+	for (; level > 0; level--) {
+		if (path[level].hdr->entries == 0)
+			break;
+		logical = ext_entries(path[level].hdr)[0].logical;
+		if (ext_index(path[level - 1].hdr)[path[level - 1].pos].logical <= logical)
+			break;
+		ext_index(path[level - 1].hdr)[path[level - 1].pos].logical = logical;
+		ext_dirty(i, &path[level - 1]);
+	}
+}
+
+/* look up 'max' logical blocks from 'logical_block' on, like
+ * read_block_map() does for the block map. returns the num of blocks
+ * that are all holes, or all mapped to consecutive blocks of one
+ * extent, and the raw entry of the first in 'entry'.
+ */
+int jaguar_ext_lookup(struct inode *i, int logical_block, int max,
+	unsigned int *entry)
+{
+	int depth, pos;
+	unsigned int n, off, next;
+	struct jaguar_inode *ji = (struct jaguar_inode *)i->i_private;
+	struct ext_path path[JAGUAR_EXT_MAX_DEPTH];
+	struct jaguar_extent *ex;
+
+	*entry = 0;
+
+	depth = ext_find(i->i_sb, &ji->disk_copy, logical_block, path);
+	if (depth < 0)
+		return depth;
+
+	pos = path[depth].pos;
+	if (pos >= 0) {
+		ex = &ext_entries(path[depth].hdr)[pos];
+		if (logical_block - ex->logical < ext_len(ex)) {
+			off = logical_block - ex->logical;
+			*entry = (ex->start + off) | (ex->len & JAGUAR_UNWRITTEN);
+			n = ext_len(ex) - off;
+			goto out;
+		}
+	}
+
+	/* a hole, up to the next extent */
+	next = ext_next_logical(path, depth);
+	n = next - logical_block;
+
+out:
+	ext_release_path(path, depth);
+	if (n > max)
+		n = max;
+	return n;
+}
+
+/* whether extent 'b' continues extent 'a' */
+static int ext_can_merge(struct jaguar_extent *a, struct jaguar_extent *b)
+{
+	return a->logical + ext_len(a) == b->logical &&
+		a->start + ext_len(a) == b->start &&
+		(a->len & JAGUAR_UNWRITTEN) == (b->len & JAGUAR_UNWRITTEN) &&
+		ext_len(a) + ext_len(b) <= JAGUAR_EXT_MAX_LEN;
+}
+
+/* get a zeroed extent block near 'goal' */
+static struct buffer_head *ext_new_block(struct inode *i, int goal, int depth)
+{
+	int block;
+	struct buffer_head *bh;
+	struct jaguar_extent_header *hdr;
+
+	if ((block = alloc_map_block(i, goal)) < 0) {
+		ERR("could not allocate extent block\n");
+		return NULL;
+	}
+
+	if ((bh = __getblk(i->i_sb->s_bdev, block, JAGUAR_BLOCK_SIZE)) == NULL) {
+		ERR("could not get buffer head for extent block\n");
+		free_data_block(i->i_sb, block);
+		return NULL;
+	}
+
+	set_buffer_uptodate(bh);
+	memset(bh->b_data, 0, JAGUAR_BLOCK_SIZE);
+
+	hdr = (struct jaguar_extent_header *)bh->b_data;
+	hdr->magic = JAGUAR_EXT_MAGIC;
+	hdr->max = JAGUAR_EXT_PER_BLOCK;
+	hdr->depth = depth;
+	mark_buffer_dirty(bh);
+
+	DBG("ext_new_block: allocated blk %d, depth %d\n", block, depth);
+	return bh;
+}
+
+/* the root is full. move its entries to a new block, and make the root
+ * a single index entry pointing to it.
+ */
+static int ext_grow(struct inode *i, struct ext_path *path, int goal)
+{
+	struct jaguar_extent_header *root = path[0].hdr, *hdr;
+	struct jaguar_extent_idx *idx;
+	struct buffer_head *bh;
+
+	if (root->depth + 1 >= JAGUAR_EXT_MAX_DEPTH) {
+		ERR("extent tree too deep\n");
+		return -EFBIG;
+	}
+
+	if ((bh = ext_new_block(i, goal, root->depth)) == NULL)
+		return -ENOSPC;
+
+	hdr = (struct jaguar_extent_header *)bh->b_data;
+	memcpy(ext_entries(hdr), ext_entries(root),
+		root->entries * sizeof(struct jaguar_extent));
+	hdr->entries = root->entries;
+	mark_buffer_dirty(bh);
+
+	idx = ext_index(root);
+	idx->logical = root->entries ? ext_entries(root)[0].logical : 0;
+	idx->block = bh->b_blocknr;
+	idx->rsvd = 0;
+	root->entries = 1;
+	root->depth++;
+	mark_inode_dirty(i);
+
+	DBG("ext_grow: depth now %d\n", root->depth);
+	brelse(bh);
+	return 0;
+}
+
+/* split the full node at 'level' in two. its parent has room for the
+ * new index entry. an append moves only the last entry, so a file
+ * written sequentially leaves its extent blocks full.
+ */
+static int ext_split(struct inode *i, struct ext_path *path, int level, int goal)
+{
+	int m, n, pos;
+	struct jaguar_extent_header *hdr = path[level].hdr, *new_hdr;
+	struct jaguar_extent_header *parent = path[level - 1].hdr;
+	struct jaguar_extent_idx *idx;
+	struct buffer_head *bh;
+
+	n = hdr->entries;
+	m = (path[level].pos == n - 1) ? n - 1 : n / 2;
+
+	if ((bh = ext_new_block(i, goal, hdr->depth)) == NULL)
+		return -ENOSPC;
+
+	new_hdr = (struct jaguar_extent_header *)bh->b_data;
+	memcpy(ext_entries(new_hdr), ext_entries(hdr) + m,
+		(n - m) * sizeof(struct jaguar_extent));
+	new_hdr->entries = n - m;
+	hdr->entries = m;
+	mark_buffer_dirty(bh);
+	ext_dirty(i, &path[level]);
+
+	/* add the new node to the parent, right after the old one */
+	pos = path[level - 1].pos + 1;
+	idx = ext_index(parent);
+	memmove(idx + pos + 1, idx + pos,
+		(parent->entries - pos) * sizeof(struct jaguar_extent_idx));
+	idx[pos].logical = ext_entries(new_hdr)[0].logical;
+	idx[pos].block = bh->b_blocknr;
+	idx[pos].rsvd = 0;
+	parent->entries++;
+	ext_dirty(i, &path[level - 1]);
+
+	DBG("ext_split: level %d, kept %d, moved %d\n", level, m, n - m);
+	brelse(bh);
+	return 0;
+}
+
+/* the leaf at 'depth' is too full for what is being added. split the
+ * lowest node whose parent has room, or grow the tree if every node up
+ * to the root is full. the caller releases the path and finds the leaf
+ * again.
+ */
+static int ext_make_room(struct inode *i, struct ext_path *path, int depth,
+	int goal)
+{
+	int level;
+
+	for (level = depth - 1; level >= 0; level--) {
+		if (path[level].hdr->entries < path[level].hdr->max)
+			break;
+	}
+	if (level < 0)
+		return ext_grow(i, path, goal);
+	return ext_split(i, path, level + 1, goal);
+}
+
+/* add extent 'new' to the tree. the blocks it maps must be holes. */
+static int ext_insert(struct inode *i, struct jaguar_extent *new)
+{
+	int depth, pos, ret = 0;
+	struct jaguar_inode *ji = (struct jaguar_inode *)i->i_private;
+	struct ext_path path[JAGUAR_EXT_MAX_DEPTH];
+	struct jaguar_extent_header *leaf;
+	struct jaguar_extent *ex;
+
+	DBG("ext_insert: log=%u, phys=%u, len=%x\n", new->logical, new->start,
+		new->len);
+
+retry:
+	depth = ext_find(i->i_sb, &ji->disk_copy, new->logical, path);
+	if (depth < 0)
+		return depth;
+
+	leaf = path[depth].hdr;
+	pos = path[depth].pos;
+	ex = ext_entries(leaf);
+
+	/* continue the extent before, and maybe join the one after too */
+	if (pos >= 0 && ext_can_merge(&ex[pos], new)) {
+		ex[pos].len += ext_len(new);
+		if (pos + 1 < leaf->entries && ext_can_merge(&ex[pos], &ex[pos + 1])) {
+			ex[pos].len += ext_len(&ex[pos + 1]);
+			memmove(ex + pos + 1, ex + pos + 2,
+				(leaf->entries - pos - 2) * sizeof(*ex));
+			leaf->entries--;
+		}
+		ext_dirty(i, &path[depth]);
+		goto out;
+	}
+
+	/* or extend the one after backwards */
+	if (pos + 1 < leaf->entries && ext_can_merge(new, &ex[pos + 1])) {
+		ex[pos + 1].logical = new->logical;
+		ex[pos + 1].start = new->start;
+		ex[pos + 1].len += ext_len(new);
+		ext_dirty(i, &path[depth]);
+		if (pos + 1 == 0)
+			ext_fix_keys(i, path, depth);
+		goto out;
+	}
+
+	if (leaf->entries < leaf->max) {
+		memmove(ex + pos + 2, ex + pos + 1,
+			(leaf->entries - pos - 1) * sizeof(*ex));
+		ex[pos + 1] = *new;
+		leaf->entries++;
+		ext_dirty(i, &path[depth]);
+		if (pos + 1 == 0)
+			ext_fix_keys(i, path, depth);
+		goto out;
+	}
+
+	/* the leaf is full, make room and try again */
+	ret = ext_make_room(i, path, depth, new->start);
+	ext_release_path(path, depth);
+	if (ret)
+		return ret;
+	goto retry;
+
+out:
+	ext_release_path(path, depth);
+	return ret;
+}
+
+/* map 'count' logical blocks from 'logical_block' on to the physical
+ * blocks from 'phys_block' on, with 'flags' (0 or JAGUAR_UNWRITTEN).
+ * the blocks are either holes, or already mapped to the same physical
+ * blocks, in which case only the unwritten flag changes.
+ * returns the num of blocks mapped, or < 0 on error.
+ */
+int jaguar_ext_map(struct inode *i, int logical_block, int phys_block,
+	int count, unsigned int flags)
+{
+	int depth, pos, ret, k, end;
+	unsigned int n, head, tail, old_flags;
+	struct jaguar_inode *ji = (struct jaguar_inode *)i->i_private;
+	struct ext_path path[JAGUAR_EXT_MAX_DEPTH];
+	struct jaguar_extent_header *leaf;
+	struct jaguar_extent *ex, new, parts[3];
+
+	DBG("jaguar_ext_map: entering log=%d, phys=%d, count=%d, flags=%x\n",
+		logical_block, phys_block, count, flags);
+
+retry:
+	depth = ext_find(i->i_sb, &ji->disk_copy, logical_block, path);
+	if (depth < 0)
+		return depth;
+
+	leaf = path[depth].hdr;
+	pos = path[depth].pos;
+	ex = pos >= 0 ? &ext_entries(leaf)[pos] : NULL;
+
+	if (!ex || logical_block - ex->logical >= ext_len(ex)) {
+		/* a hole. map as much of it as was asked for */
+		n = ext_next_logical(path, depth) - logical_block;
+		if (n > count)
+			n = count;
+		ext_release_path(path, depth);
+
+		new.logical = logical_block;
+		new.start = phys_block;
+		new.len = n | flags;
+		ret = ext_insert(i, &new);
+		return ret ? ret : n;
+	}
+
+	head = logical_block - ex->logical;
+	if (ex->start + head != phys_block) {
+		ERR("remapping logical block %d\n", logical_block);
+		ext_release_path(path, depth);
+		return -EIO;
+	}
+
+	n = ext_len(ex) - head;
+	if (n > count)
+		n = count;
+	tail = ext_len(ex) - head - n;
+	old_flags = ex->len & JAGUAR_UNWRITTEN;
+
+	if (old_flags == flags) {
+		ext_release_path(path, depth);
+		return n;
+	}
+
+	/* change the flag of the middle part of the extent, replacing it
+	 * with up to three extents in its leaf. room is made for them
+	 * before the extent is touched, so a failed split loses nothing.
+	 */
+	k = 0;
+	if (head) {
+		parts[k].logical = ex->logical;
+		parts[k].start = ex->start;
+		parts[k++].len = head | old_flags;
+	}
+	parts[k].logical = logical_block;
+	parts[k].start = phys_block;
+	parts[k++].len = n | flags;
+	if (tail) {
+		parts[k].logical = logical_block + n;
+		parts[k].start = phys_block + n;
+		parts[k++].len = tail | old_flags;
+	}
+
+	if (leaf->entries + k - 1 > leaf->max) {
+		ret = ext_make_room(i, path, depth, phys_block);
+		ext_release_path(path, depth);
+		if (ret) {
+			ERR("could not split extent at logical block %d\n",
+				logical_block);
+			return ret;
+		}
+		goto retry;
+	}
+
+	ex = ext_entries(leaf);
+	memmove(ex + pos + k, ex + pos + 1,
+		(leaf->entries - pos - 1) * sizeof(*ex));
+	memcpy(ex + pos, parts, k * sizeof(*ex));
+	leaf->entries += k - 1;
+
+	/* join the new parts with their neighbours where they continue
+	 * each other
+	 */
+	end = pos + k;
+	for (k = pos > 0 ? pos - 1 : 0; k < end && k + 1 < leaf->entries; ) {
+		if (!ext_can_merge(&ex[k], &ex[k + 1])) {
+			k++;
+			continue;
+		}
+		ex[k].len += ext_len(&ex[k + 1]);
+		memmove(ex + k + 1, ex + k + 2,
+			(leaf->entries - k - 2) * sizeof(*ex));
+		leaf->entries--;
+		end--;
+	}
+
+	/* the first part starts where the extent did, the keys hold */
+	ext_dirty(i, &path[depth]);
+	ext_release_path(path, depth);
+
+	return n;
+}
+
+static int ext_free_node(struct super_block *sb, struct jaguar_extent_header *hdr,
+	struct jaguar_free_batch *fb)
+{
+	int ret = 0, n, block;
+	unsigned int b;
+	struct jaguar_extent *ex;
+	struct jaguar_extent_header *child;
+	struct buffer_head *bh;
+
+	if (hdr->magic != JAGUAR_EXT_MAGIC || hdr->entries > hdr->max) {
+		ERR("corrupt extent tree\n");
+		return -EIO;
+	}
+
+	if (hdr->depth == 0) {
+		for (n = 0; n < hdr->entries; n++) {
+			ex = &ext_entries(hdr)[n];
+			for (b = 0; b < ext_len(ex) && !ret; b++)
+				ret = free_batch_add(fb, ex->start + b);
+		}
+		return ret;
+	}
+
+	for (n = 0; n < hdr->entries && !ret; n++) {
+		block = ext_index(hdr)[n].block;
+		if ((bh = __bread(sb->s_bdev, block, JAGUAR_BLOCK_SIZE)) == NULL) {
+			ERR("could not read extent block %d\n", block);
+			return -EIO;
+		}
+		child = (struct jaguar_extent_header *)bh->b_data;
+		if (child->depth != hdr->depth - 1) {
+			ERR("corrupt extent tree\n");
+			ret = -EIO;
+		} else {
+			ret = ext_free_node(sb, child, fb);
+		}
+		brelse(bh);
+
+		/* all blocks below have been freed, now free this one */
+		if (!ret)
+			ret = free_batch_add(fb, block);
+	}
+
+	return ret;
+}
+
+/* free the blocks mapped from 'logical' on, below a node. nodes left
+ * with no entries are freed too, and dropped from their parent.
+ */
+static int ext_truncate_node(struct super_block *sb, struct jaguar_extent_header *hdr,
+	unsigned int logical, struct jaguar_free_batch *fb)
+{
+	int ret = 0, block;
+	unsigned int b, keep;
+	struct jaguar_extent *ex;
+	struct jaguar_extent_header *child;
+	struct buffer_head *bh;
+
+	if (hdr->magic != JAGUAR_EXT_MAGIC || hdr->entries > hdr->max) {
+		ERR("corrupt extent tree\n");
+		return -EIO;
+	}
+
+	/* the entries are sorted, so the work is all at the end */
+	while (hdr->entries > 0 && !ret) {
+		if (hdr->depth == 0) {
+			ex = &ext_entries(hdr)[hdr->entries - 1];
+			if (ex->logical + ext_len(ex) <= logical)
+				break;
+
+			keep = ex->logical < logical ? logical - ex->logical : 0;
+			for (b = keep; b < ext_len(ex) && !ret; b++)
+				ret = free_batch_add(fb, ex->start + b);
+
+			if (keep) {
+				ex->len = keep | (ex->len & JAGUAR_UNWRITTEN);
+				break;
+			}
+			hdr->entries--;
+			continue;
+		}
+
+		block = ext_index(hdr)[hdr->entries - 1].block;
+		if ((bh = __bread(sb->s_bdev, block, JAGUAR_BLOCK_SIZE)) == NULL) {
+			ERR("could not read extent block %d\n", block);
+			return -EIO;
+		}
+		child = (struct jaguar_extent_header *)bh->b_data;
+		if (child->depth != hdr->depth - 1) {
+			ERR("corrupt extent tree\n");
+			ret = -EIO;
+		} else {
+			ret = ext_truncate_node(sb, child, logical, fb);
+		}
+		mark_buffer_dirty(bh);
+
+		/* a child that keeps entries holds the new end */
+		if (ret || child->entries) {
+			brelse(bh);
+			break;
+		}
+
+		bforget(bh);
+		ret = free_batch_add(fb, block);
+		hdr->entries--;
+	}
+
+	return ret;
+}
+
+/* free the blocks of an inode from 'logical_block' on. the caller
+ * updates the mapping cache.
+ */
+int jaguar_ext_truncate(struct inode *i, int logical_block,
+	struct jaguar_free_batch *fb)
+{
+	int ret;
+	struct jaguar_inode *ji = (struct jaguar_inode *)i->i_private;
+	struct jaguar_extent_header *root = ext_root(&ji->disk_copy);
+
+	DBG("jaguar_ext_truncate: entering, inum=%d, logical=%d\n",
+		(int)i->i_ino, logical_block);
+
+	ret = ext_truncate_node(i->i_sb, root, logical_block, fb);
+
+	/* an empty tree starts over as a leaf */
+	if (root->entries == 0)
+		root->depth = 0;
+	mark_inode_dirty(i);
+
+	return ret;
+}
+
+/* free all data and extent blocks of an on-disk inode */
+int jaguar_ext_free(struct super_block *sb, struct jaguar_inode_on_disk *jid,
+	struct jaguar_free_batch *fb)
+{
+	DBG("jaguar_ext_free: entering, depth=%d\n", ext_root(jid)->depth);
+
+	return ext_free_node(sb, ext_root(jid), fb);
+}
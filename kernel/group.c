@@ -0,0 +1,510 @@
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/vmalloc.h>
+#include "jaguar.h"
+#include "debug.h"
+
+/* range of data blocks [*lo, *hi) owned by group 'g' */
+static void group_block_range(struct jaguar_super_block *jsb, int g,
+	int *lo, int *hi)
+{
+	*lo = g * JAGUAR_BLOCKS_PER_GROUP;
+	*hi = jsb->disk_copy->n_blocks;
+	if (*hi - *lo > JAGUAR_BLOCKS_PER_GROUP)
+		*hi = *lo + JAGUAR_BLOCKS_PER_GROUP;
+}
+
+/* range of inodes [*lo, *hi) owned by group 'g' */
+static void group_inode_range(struct jaguar_super_block *jsb, int g,
+	int *lo, int *hi)
+{
+	*lo = g * JAGUAR_INODES_PER_GROUP;
+	*hi = jsb->disk_copy->n_inodes;
+	if (*hi - *lo > JAGUAR_INODES_PER_GROUP)
+		*hi = *lo + JAGUAR_INODES_PER_GROUP;
+}
+
+/* read the group descriptor table, and pin its buffers.
+ * the free counts of every group are checked against the bitmaps, and
+ * the super block totals are refreshed from them.
+ */
+int jaguar_load_groups(struct super_block *sb)
+{
+	int ret = 0, g, lo, hi, n_free, n_blocks_free = 0, n_inodes_free = 0;
+	int gdt_start;
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+	struct jaguar_super_block_on_disk *jsbd = jsb->disk_copy;
+	struct jaguar_group *grp;
+
+	DBG("jaguar_load_groups: entering, n_groups=%d\n", jsbd->n_groups);
+
+	if (jsbd->n_groups <= 0 || (long long)jsbd->n_groups *
+			JAGUAR_BLOCKS_PER_GROUP < jsbd->n_blocks) {
+		ERR("invalid group count %d, re-run mkfs\n", jsbd->n_groups);
+		ret = -EINVAL;
+		goto fail;
+	}
+
+	jsb->data_bmap.start = SB_LAYOUT_BLOCK(jsbd, data_bmap_start);
+	jsb->data_bmap.size = SB_LAYOUT_BLOCK(jsbd, data_bmap_size);
+	jsb->data_bmap.nbits = jsbd->n_blocks;
+	jsb->inode_bmap.start = SB_LAYOUT_BLOCK(jsbd, inode_bmap_start);
+	jsb->inode_bmap.size = SB_LAYOUT_BLOCK(jsbd, inode_bmap_size);
+	jsb->inode_bmap.nbits = jsbd->n_inodes;
+	spin_lock_init(&jsb->lock);
+	INIT_LIST_HEAD(&jsb->prealloc_inodes);
+	jsb->n_prealloc_inodes = 0;
+
+	/* a multi-terabyte fs has tens of thousands of groups */
+	if ((jsb->groups = vzalloc(jsbd->n_groups * sizeof(*jsb->groups))) == NULL) {
+		ERR("no memory\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	gdt_start = SB_LAYOUT_BLOCK(jsbd, gdt_start);
+	for (g = 0; g < jsbd->n_groups; g++) {
+		grp = &jsb->groups[g];
+		mutex_init(&grp->lock);
+		INIT_LIST_HEAD(&grp->windows);
+
+		/* all descriptors in one gdt block share its buffer head.
+		 * each group holds its own reference on it.
+		 */
+		if ((grp->bh = __bread(sb->s_bdev, gdt_start +
+				g / JAGUAR_GROUP_DESCS_PER_BLOCK,
+				JAGUAR_BLOCK_SIZE)) == NULL) {
+			ERR("error reading group descriptors from disk\n");
+			ret = -EIO;
+			goto fail;
+		}
+		grp->desc = (struct jaguar_group_desc_on_disk *)grp->bh->b_data +
+			g % JAGUAR_GROUP_DESCS_PER_BLOCK;
+
+		group_block_range(jsb, g, &lo, &hi);
+		n_free = jaguar_bmap_count_free(sb, &jsb->data_bmap, lo, hi);
+		if (n_free < 0) {
+			ret = n_free;
+			goto fail;
+		}
+		if (n_free != grp->desc->n_blocks_free) {
+			ERR("group %d: fixing free block count %d -> %d\n",
+				g, grp->desc->n_blocks_free, n_free);
+			grp->desc->n_blocks_free = n_free;
+			mark_buffer_dirty(grp->bh);
+		}
+		n_blocks_free += n_free;
+
+		group_inode_range(jsb, g, &lo, &hi);
+		n_free = 0;
+		if (lo < hi &&
+		    (n_free = jaguar_bmap_count_free(sb, &jsb->inode_bmap, lo, hi)) < 0) {
+			ret = n_free;
+			goto fail;
+		}
+		if (n_free != grp->desc->n_inodes_free) {
+			ERR("group %d: fixing free inode count %d -> %d\n",
+				g, grp->desc->n_inodes_free, n_free);
+			grp->desc->n_inodes_free = n_free;
+			mark_buffer_dirty(grp->bh);
+		}
+		n_inodes_free += n_free;
+
+		DBG("group %d: %d blocks free, %d inodes free\n", g,
+			grp->desc->n_blocks_free, grp->desc->n_inodes_free);
+	}
+
+	if (n_blocks_free != jsbd->n_blocks_free ||
+	    n_inodes_free != jsbd->n_inodes_free) {
+		jsbd->n_blocks_free = n_blocks_free;
+		jsbd->n_inodes_free = n_inodes_free;
+		mark_buffer_dirty(jsb->bh);
+	}
+
+	return 0;
+
+fail:
+	jaguar_put_groups(sb);
+	return ret;
+}
+
+void jaguar_put_groups(struct super_block *sb)
+{
+	int g;
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+
+	if (!jsb->groups)
+		return;
+
+	for (g = 0; g < jsb->disk_copy->n_groups; g++)
+		if (jsb->groups[g].bh)
+			brelse(jsb->groups[g].bh);
+
+	vfree(jsb->groups);
+	jsb->groups = NULL;
+}
+
+/* the group this cpu prefers when there is no better goal.
+ * spreading cpus over groups lets parallel allocators run without
+ * contending on the same group lock.
+ */
+int jaguar_preferred_group(struct super_block *sb)
+{
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+
+	return raw_smp_processor_id() % jsb->disk_copy->n_groups;
+}
+
+/* pick the group for a new directory.
+ * directories are spread out, so that each one has room to keep its
+ * files and their data close to it: the group with the most free
+ * blocks wins, among those that still have free inodes.
+ * the counts are read without the group locks, it is only a hint.
+ */
+int jaguar_group_for_dir(struct super_block *sb)
+{
+	int g, n, best, n_groups;
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+	struct jaguar_group_desc_on_disk *desc, *best_desc = NULL;
+
+	n_groups = jsb->disk_copy->n_groups;
+
+	/* start at the cpu's group, so that ties go to different groups */
+	best = g = jaguar_preferred_group(sb);
+	for (n = 0; n < n_groups; n++, g = (g + 1) % n_groups) {
+		desc = jsb->groups[g].desc;
+		if (desc->n_inodes_free == 0)
+			continue;
+		if (!best_desc || desc->n_blocks_free > best_desc->n_blocks_free) {
+			best = g;
+			best_desc = desc;
+		}
+	}
+
+	return best;
+}
+
+/* a goal block in 'group' for callers with nothing better to go by:
+ * the group's own allocation hint.
+ */
+int jaguar_group_goal(struct super_block *sb, int group)
+{
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+
+	return group * JAGUAR_BLOCKS_PER_GROUP +
+		jsb->groups[group].desc->next_free_block;
+}
+
+/* make the free blocks [start, start + len) of group 'grp' the
+ * preallocation window of 'ji'. the window is kept only in memory, the
+ * bitmap on disk still has the blocks free.
+ */
+static void add_window(struct jaguar_super_block *jsb, struct jaguar_group *grp,
+	struct jaguar_inode *ji, int start, int len)
+{
+	spin_lock(&jsb->lock);
+	/* a racing allocation for the inode got a window first */
+	if (ji->pa_len == 0) {
+		ji->pa_start = start;
+		ji->pa_len = len;
+		list_add_tail(&ji->pa_list, &jsb->prealloc_inodes);
+		list_add_tail(&ji->pa_group_list, &grp->windows);
+		grp->n_prealloc += len;
+		jsb->n_blocks_prealloc += len;
+		jsb->n_prealloc_inodes++;
+	}
+	spin_unlock(&jsb->lock);
+}
+
+/* allocate a run of at least 'min' and at most 'max' contiguous data
+ * blocks, starting at or near 'goal'. groups are tried starting with
+ * the group of 'goal'; groups that are too full are skipped without
+ * taking their lock or reading their bitmap. the preallocation windows
+ * of other inodes are not allocated from.
+ * if 'ji' is given, up to 'pa_max' free blocks right after the run
+ * become its preallocation window.
+ */
+int jaguar_group_alloc_blocks(struct super_block *sb, int goal,
+	int min, int max, int *count, struct jaguar_inode *ji, int pa_max)
+{
+	int ret = -ENOSPC, err, g, first, lo, hi, n_groups, hinted, n;
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+	struct jaguar_group *grp;
+
+	n_groups = jsb->disk_copy->n_groups;
+	if (!ji)
+		pa_max = 0;
+
+	if (goal > 0 && goal < jsb->disk_copy->n_blocks)
+		first = BLOCK_TO_GROUP(goal);
+	else
+		first = jaguar_preferred_group(sb);
+
+	g = first;
+	do {
+		grp = &jsb->groups[g];
+		if (grp->desc->n_blocks_free - grp->n_prealloc < min)
+			goto next;
+
+		mutex_lock(&grp->lock);
+
+		group_block_range(jsb, g, &lo, &hi);
+		hinted = (g != first || goal <= 0);
+		if (hinted)
+			goal = lo + grp->desc->next_free_block;
+
+		ret = jaguar_bmap_find_run(sb, &jsb->data_bmap, lo, hi,
+				goal, min, max + pa_max, &n, &grp->windows);
+		if (ret >= 0) {
+			*count = min(n, max);
+			if ((err = jaguar_bmap_set_run(sb, &jsb->data_bmap, ret,
+					*count)))
+				ret = err;
+		}
+		if (ret >= 0) {
+			grp->desc->n_blocks_free -= *count;
+
+			/* only allocations without a goal of their own move
+			 * the hint, so that placement near an inode does not
+			 * drag the next unrelated file along.
+			 */
+			if (hinted) {
+				grp->desc->next_free_block = ret + *count - lo;
+				if (grp->desc->next_free_block >= hi - lo)
+					grp->desc->next_free_block = 0;
+			}
+			mark_buffer_dirty(grp->bh);
+
+			/* the window is made before the group is unlocked,
+			 * so no other allocation can take its blocks.
+			 */
+			if (n > *count)
+				add_window(jsb, grp, ji, ret + *count, n - *count);
+		}
+
+		mutex_unlock(&grp->lock);
+
+		if (ret >= 0)
+			break;
+		if (ret != -ENOSPC)
+			goto fail;
+next:
+		g = (g + 1) % n_groups;
+	} while (g != first);
+
+	if (ret < 0)
+		goto fail;
+
+	/* update super block info */
+	spin_lock(&jsb->lock);
+	jsb->disk_copy->n_blocks_free -= *count;
+	spin_unlock(&jsb->lock);
+	mark_buffer_dirty(jsb->bh);
+
+fail:
+	return ret;
+}
+
+/* take up to 'max' blocks from the preallocation window of 'ji', if
+ * the window starts at 'goal'. the blocks are allocated in the bitmap.
+ * returns the first block, with the num taken in 'count', or 0 if the
+ * window does not start at 'goal', or < 0 on error.
+ */
+int jaguar_group_take_window(struct super_block *sb, struct jaguar_inode *ji,
+	int goal, int max, int *count)
+{
+	int ret = 0, err;
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+	struct jaguar_group *grp;
+
+	if (goal <= 0 || goal >= jsb->disk_copy->n_blocks)
+		return 0;
+	grp = &jsb->groups[BLOCK_TO_GROUP(goal)];
+
+	mutex_lock(&grp->lock);
+
+	spin_lock(&jsb->lock);
+	if (ji->pa_len && ji->pa_start == goal) {
+		*count = min(max, ji->pa_len);
+		ret = ji->pa_start;
+		ji->pa_start += *count;
+		ji->pa_len -= *count;
+		grp->n_prealloc -= *count;
+		jsb->n_blocks_prealloc -= *count;
+		if (ji->pa_len == 0) {
+			list_del_init(&ji->pa_list);
+			list_del_init(&ji->pa_group_list);
+			jsb->n_prealloc_inodes--;
+		}
+	}
+	spin_unlock(&jsb->lock);
+
+	if (ret > 0) {
+		/* on failure the blocks just go back to being free */
+		if ((err = jaguar_bmap_set_run(sb, &jsb->data_bmap, ret, *count))) {
+			ret = err;
+		} else {
+			grp->desc->n_blocks_free -= *count;
+			mark_buffer_dirty(grp->bh);
+		}
+	}
+
+	mutex_unlock(&grp->lock);
+
+	if (ret > 0) {
+		spin_lock(&jsb->lock);
+		jsb->disk_copy->n_blocks_free -= *count;
+		spin_unlock(&jsb->lock);
+		mark_buffer_dirty(jsb->bh);
+	}
+
+	return ret;
+}
+
+int jaguar_group_free_block(struct super_block *sb, int block)
+{
+	return jaguar_group_free_blocks(sb, &block, 1);
+}
+
+/* free a sorted list of 'n' data blocks.
+ * the blocks of each group are freed under one hold of its lock, with
+ * one read of its bitmap block. the super block counter is updated once.
+ * a bad block, or a group whose bitmap cannot be read, does not stop
+ * the rest from being freed. returns the first error seen.
+ */
+int jaguar_group_free_blocks(struct super_block *sb, int *blocks, int n)
+{
+	int ret = 0, err, g, j, k, n_freed = 0;
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+	struct jaguar_group *grp;
+
+	for (j = 0; j < n; j = k) {
+		if (blocks[j] <= 0 || blocks[j] >= jsb->disk_copy->n_blocks) {
+			ERR("freeing invalid block %d\n", blocks[j]);
+			if (!ret)
+				ret = -EINVAL;
+			k = j + 1;
+			continue;
+		}
+
+		/* the blocks of this group are blocks[j..k-1] */
+		g = BLOCK_TO_GROUP(blocks[j]);
+		for (k = j + 1; k < n && BLOCK_TO_GROUP(blocks[k]) == g &&
+				blocks[k] < jsb->disk_copy->n_blocks; k++)
+			;
+		grp = &jsb->groups[g];
+
+		mutex_lock(&grp->lock);
+		err = jaguar_bmap_free_bits(sb, &jsb->data_bmap, blocks + j, k - j);
+		if (err > 0) {
+			grp->desc->n_blocks_free += err;
+			mark_buffer_dirty(grp->bh);
+			n_freed += err;
+		}
+		mutex_unlock(&grp->lock);
+
+		/* some of the blocks were bad, or none could be freed */
+		if (err < 0 && !ret)
+			ret = err;
+		else if (err >= 0 && err < k - j && !ret)
+			ret = -EINVAL;
+	}
+
+	if (n_freed) {
+		/* update super block info */
+		spin_lock(&jsb->lock);
+		jsb->disk_copy->n_blocks_free += n_freed;
+		spin_unlock(&jsb->lock);
+		mark_buffer_dirty(jsb->bh);
+	}
+
+	return ret;
+}
+
+/* allocate an inode, preferably from 'group' */
+int jaguar_group_alloc_inode(struct super_block *sb, int group)
+{
+	int ret = -ENOSPC, g, lo, hi, count, n_groups;
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+	struct jaguar_group *grp;
+
+	n_groups = jsb->disk_copy->n_groups;
+	if (group < 0 || group >= n_groups)
+		group = jaguar_preferred_group(sb);
+
+	g = group;
+	do {
+		grp = &jsb->groups[g];
+		if (grp->desc->n_inodes_free == 0)
+			goto next;
+
+		mutex_lock(&grp->lock);
+
+		group_inode_range(jsb, g, &lo, &hi);
+		ret = jaguar_bmap_alloc_run(sb, &jsb->inode_bmap, lo, hi,
+				lo + grp->desc->next_free_inode, 1, 1, &count);
+		if (ret >= 0) {
+			grp->desc->n_inodes_free--;
+			grp->desc->next_free_inode = ret + 1 - lo;
+			if (grp->desc->next_free_inode >= hi - lo)
+				grp->desc->next_free_inode = 0;
+			mark_buffer_dirty(grp->bh);
+		}
+
+		mutex_unlock(&grp->lock);
+
+		if (ret >= 0)
+			break;
+		if (ret != -ENOSPC)
+			goto fail;
+next:
+		g = (g + 1) % n_groups;
+	} while (g != group);
+
+	if (ret < 0)
+		goto fail;
+
+	/* update super block info */
+	spin_lock(&jsb->lock);
+	jsb->disk_copy->n_inodes_free--;
+	spin_unlock(&jsb->lock);
+	mark_buffer_dirty(jsb->bh);
+
+fail:
+	return ret;
+}
+
+int jaguar_group_free_inode(struct super_block *sb, int inum)
+{
+	int ret;
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+	struct jaguar_group *grp;
+
+	if (inum <= 1 || inum >= jsb->disk_copy->n_inodes) {
+		ERR("freeing invalid inode %d\n", inum);
+		return -EINVAL;
+	}
+	grp = &jsb->groups[INUM_TO_GROUP(inum)];
+
+	mutex_lock(&grp->lock);
+	ret = jaguar_bmap_free_bit(sb, &jsb->inode_bmap, inum);
+	if (ret == 0) {
+		grp->desc->n_inodes_free++;
+		mark_buffer_dirty(grp->bh);
+	}
+	mutex_unlock(&grp->lock);
+
+	if (ret)
+		goto fail;
+
+	/* update super block info */
+	spin_lock(&jsb->lock);
+	jsb->disk_copy->n_inodes_free++;
+	spin_unlock(&jsb->lock);
+	mark_buffer_dirty(jsb->bh);
+
+fail:
+	return ret;
+}
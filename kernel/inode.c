@@ -4,6 +4,14 @@
 #include <linux/time.h>
 #include <linux/mount.h>
 #include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/pagevec.h>
+#include <linux/writeback.h>
+#include <linux/mpage.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/falloc.h>
+#include <linux/aio.h>
 #include <asm/uaccess.h>
 #include "jaguar.h"
 #include "debug.h"
@@ -17,23 +25,59 @@ static void version(struct file *filp, struct inode *i, int logical_block, int p
 static int jaguar_open(struct inode *i, struct file *f);
 static int jaguar_release(struct inode *i, struct file *f);
 
-static int logical_to_phys_block(struct inode *i, int logical_block)
+/* start reading the blocks in entries [from, from + JAGUAR_IND_READAHEAD)
+ * of an indirect block, without waiting for them.
+ */
+static void indirect_readahead(struct super_block *sb, unsigned int *block_map,
+	int from)
+{
+	int n;
+
+	for (n = from; n < from + JAGUAR_IND_READAHEAD &&
+			n < JAGUAR_BLOCK_SIZE / 4; n++) {
+		if (block_map[n])
+			__breadahead(sb->s_bdev, block_map[n], JAGUAR_BLOCK_SIZE);
+	}
+}
+
+/* look up the block map entries of 'max' logical blocks starting at
+ * 'logical_block', and return how many of them, from the first one on,
+ * are either all holes, or map to consecutive physical blocks with the
+ * same flags. the raw entry of the first block, flags included, is
+ * returned in 'entry' (0 for a hole).
+ * a missing indirect block counts as a hole over its whole span, so a
+ * large hole is found without reading a block per logical block.
+ * when the lookups go through the file sequentially, the indirect
+ * blocks after the one being read are read ahead, so the walk does not
+ * stall on a metadata read every 4 MB.
+ * returns < 0 on error.
+ */
+static int read_block_map(struct inode *i, int logical_block, int max,
+	unsigned int *entry)
 {
-	int index, level, block, *block_map, block_index, ret = 0;
-	int max_blks_at_level[] = { 12, 1024, 1048576 };
+	int index, level, block, block_index, n_entries, n = 0, sequential;
+	int max_blks_at_level[] = { 12, 1024, 1048576, 1073741824 };
+	unsigned int *block_map;
 	struct jaguar_inode *ji = (struct jaguar_inode *)i->i_private;
 	struct super_block *sb = i->i_sb;
-	struct buffer_head *bh;
+	struct buffer_head *bh = NULL;
+
+	//DBG("read_block_map: entering log=%d, max=%d\n", logical_block, max);
 
-	//DBG("logical_to_phys_block: entering log=%d\n", logical_block);
+	sequential = logical_block > 0 && logical_block == ji->map_next;
+
+	*entry = 0;
 
 	index = logical_block;
 	level = 0;
 	while (index >= max_blks_at_level[level]) {
 		index -= max_blks_at_level[level];
-		level++;
+		if (++level > 3) {
+			ERR("logical block %d beyond triple indirect\n", logical_block);
+			n = -EFBIG;
+			goto out;
+		}
 	}
-	//DBG("found level = %d, index = %d\n", level, index);
 
 	/* now index corresponds to index WITHIN that level of indirection.
 	 * ie, if logical block is 1040, level = 2, index = 4.
@@ -41,26 +85,28 @@ static int logical_to_phys_block(struct inode *i, int logical_block)
 
 	/* handle the simplest case first: no indirection */
 	if (level == 0) {
-		ret = ji->disk_copy.blocks[index];
-		goto out;
+		block_map = ji->disk_copy.blocks;
+		n_entries = 12;
+		goto scan;
 	}
 
 	/* check whether an indirect block is allocated for 'level' */
 	block = ji->disk_copy.blocks[11 + level];
-	if (!block)
+	if (!block) {
+		n = max_blks_at_level[level] - index;
 		goto out;
+	}
 
 	/* read the indirect block into mem */
 	if ((bh = __bread(sb->s_bdev, block, JAGUAR_BLOCK_SIZE)) == NULL) {
 		ERR("could not read indirect block\n");
+		n = -EIO;
 		goto out;
 	}
 
-	block_map = (int *)bh->b_data;
+	block_map = (unsigned int *)bh->b_data;
 
 	while (level > 1) {
-		
-		DBG("level %d: index=%d\n", level, index);
 
 		/* indirection level is more than 1.
 		 * find out the index of the block which has the next level
@@ -72,50 +118,167 @@ static int logical_to_phys_block(struct inode *i, int logical_block)
 		index = index % max_blks_at_level[level-1];
 
 		block = block_map[block_index];
-		if (!block)
+		if (sequential)
+			indirect_readahead(sb, block_map, block_index + 1);
+		brelse(bh);
+		bh = NULL;
+		if (!block) {
+			n = max_blks_at_level[level - 1] - index;
 			goto out;
+		}
 
 		/* read the next level indirect block into mem */
-		brelse(bh);
 		if ((bh = __bread(sb->s_bdev, block, JAGUAR_BLOCK_SIZE)) == NULL) {
 			ERR("could not read indirect block\n");
+			n = -EIO;
 			goto out;
 		}
 
-		block_map = (int *)bh->b_data;
+		block_map = (unsigned int *)bh->b_data;
 
 		level--;
 	}
 
 	/* now we are at level 1 indirection */
-	ret = block_map[index];
-	brelse(bh);
+	n_entries = JAGUAR_BLOCK_SIZE / 4;
+
+scan:
+	*entry = block_map[index];
+	for (n = 1; n < max && index + n < n_entries; n++) {
+		if (*entry == 0 ? block_map[index + n] != 0 :
+		    block_map[index + n] != *entry + n)
+			break;
+	}
 
 out:
+	if (bh)
+		brelse(bh);
+	if (n > max)
+		n = max;
+	if (n > 0)
+		ji->map_next = logical_block + n;
+	return n;
+}
+
+/* same as read_block_map(), through the inode's mapping cache.
+ * on a miss, a whole run is looked up and cached, so the next blocks
+ * of a sequential read or write hit the cache.
+ */
+static int lookup_blocks(struct inode *i, int logical_block, int max,
+	unsigned int *entry)
+{
+	int n, want;
+	unsigned int seq;
+	struct jaguar_inode *ji = (struct jaguar_inode *)i->i_private;
+
+	if ((n = jaguar_mcache_lookup(i, logical_block, max, entry)) > 0)
+		return n;
+
+	seq = jaguar_mcache_seq(i);
+	want = max < JAGUAR_MCACHE_RUN ? JAGUAR_MCACHE_RUN : max;
+	mutex_lock(&ji->map_mutex);
+	if (ji->disk_copy.flags & INODE_FLG_EXTENTS)
+		n = jaguar_ext_lookup(i, logical_block, want, entry);
+	else
+		n = read_block_map(i, logical_block, want, entry);
+	mutex_unlock(&ji->map_mutex);
+
+	if (n > 0 && *entry)
+		jaguar_mcache_insert(i, logical_block, *entry, n, seq);
+	if (n > max)
+		n = max;
+
+	return n;
+}
+
+int logical_to_phys_block(struct inode *i, int logical_block)
+{
+	int ret;
+	unsigned int entry;
+
+	ret = lookup_blocks(i, logical_block, 1, &entry);
+	if (ret > 0)
+		ret = entry & ~JAGUAR_UNWRITTEN;
+	else
+		ret = 0;
+
 	DBG("logical_to_phys_block: mapped %d to %d\n", logical_block, ret);
 	return ret;
 }
 
-/* currently supports only levels 0, 1, 2 of indirection.
- * triple indirect block not yet tested.
- * shouldnt be difficult, though.
+/* the block to start searching from when allocating 'logical_block'
+ * of an inode: right after the previous logical block, else right after
+ * the last block allocated to the inode, else in the inode's own group.
+ * new files start out with the parent dir's block as their last block.
+ */
+static int find_goal(struct inode *i, int logical_block)
+{
+	int goal;
+	struct jaguar_inode *ji = (struct jaguar_inode *)i->i_private;
+
+	if (logical_block > 0 &&
+	    (goal = logical_to_phys_block(i, logical_block - 1)))
+		return goal + 1;
+
+	if (ji->last_block)
+		return ji->last_block + 1;
+
+	return jaguar_group_goal(i->i_sb, INUM_TO_GROUP(i->i_ino));
+}
+
+/* the goal for version blocks of an inode.
+ * old versions are rarely read, so they are kept away from the live
+ * data: in the last quarter of the inode's group, next to the current
+ * version metadata block.
+ */
+static int find_version_goal(struct inode *i)
+{
+	int goal;
+	struct jaguar_inode *ji = (struct jaguar_inode *)i->i_private;
+	struct jaguar_super_block *jsb = i->i_sb->s_fs_info;
+
+	if (ji->disk_copy.ver_meta_block)
+		return ji->disk_copy.ver_meta_block + 1;
+
+	goal = INUM_TO_GROUP(i->i_ino) * JAGUAR_BLOCKS_PER_GROUP +
+		JAGUAR_BLOCKS_PER_GROUP / 4 * 3;
+	if (goal >= jsb->disk_copy->n_blocks)
+		goal = jaguar_group_goal(i->i_sb, INUM_TO_GROUP(i->i_ino));
+
+	return goal;
+}
+
+/* map 'count' logical blocks starting at 'logical_block' to the
+ * physical blocks starting at 'phys_block', as far as they fall in the
+ * same direct area or the same level 1 indirect block. the entries get
+ * 'flags' (0 or JAGUAR_UNWRITTEN) or'ed in.
+ * missing indirect blocks are placed near 'phys_block', ie next to the
+ * data they map.
+ * returns the num of blocks mapped, or < 0 on error.
+ *
+ * supports levels 0 to 3 of indirection, ie up to triple indirect.
  */
-static void update_inode_block_map(struct inode *i, int logical_block, int phys_block)
+static int map_inode_blocks(struct inode *i, int logical_block, int phys_block,
+	int count, unsigned int flags)
 {
-	int index, level, save_inode, block, *block_map, block_index;
-	int max_blks_at_level[] = { 12, 1024, 1048576 };
+	int index, level, save_inode = 0, block, *block_map, block_index, n, ret;
+	int max_blks_at_level[] = { 12, 1024, 1048576, 1073741824 };
 	struct jaguar_inode *ji = (struct jaguar_inode *)i->i_private;
 	struct super_block *sb = i->i_sb;
 	struct buffer_head *bh;
 
-	DBG("update_inode_block_map: entering log=%d, phys=%d\n", 
-		logical_block, phys_block);
+	DBG("map_inode_blocks: entering log=%d, phys=%d, count=%d\n", 
+		logical_block, phys_block, count);
 
 	index = logical_block;
 	level = 0;
 	while (index >= max_blks_at_level[level]) {
 		index -= max_blks_at_level[level];
-		level++;
+		if (++level > 3) {
+			ERR("logical block %d beyond triple indirect\n", logical_block);
+			ret = -EFBIG;
+			goto fail;
+		}
 	}
 	DBG("found level = %d, index = %d\n", level, index);
 
@@ -125,16 +288,19 @@ static void update_inode_block_map(struct inode *i, int logical_block, int phys_
 
 	/* handle the simplest case first: no indirection */
 	if (level == 0) {
-		ji->disk_copy.blocks[index] = phys_block;
+		for (n = 0; n < count && index < 12; n++, index++)
+			ji->disk_copy.blocks[index] = (phys_block + n) | flags;
 		save_inode = 1;
+		ret = n;
 		goto out;
 	}
 
 	/* check whether an indirect block is allocated for 'level' */
 	block = ji->disk_copy.blocks[11 + level];
 	if (!block) {
-		if ((block = alloc_data_block(i->i_sb)) < 0) {
+		if ((block = alloc_map_block(i, phys_block)) < 0) {
 			ERR("could not allocate data block\n");
+			ret = block;
 			goto fail;
 		}
 		ji->disk_copy.blocks[11 + level] = block;
@@ -145,7 +311,8 @@ static void update_inode_block_map(struct inode *i, int logical_block, int phys_
 	/* read the indirect block into mem */
 	if ((bh = __bread(sb->s_bdev, block, JAGUAR_BLOCK_SIZE)) == NULL) {
 		ERR("could not read indirect block\n");
-		goto fail;
+		ret = -EIO;
+		goto out;
 	}
 
 	block_map = (int *)bh->b_data;
@@ -165,9 +332,11 @@ static void update_inode_block_map(struct inode *i, int logical_block, int phys_
 
 		block = block_map[block_index];
 		if (!block) {
-			if ((block = alloc_data_block(i->i_sb)) < 0) {
+			if ((block = alloc_map_block(i, phys_block)) < 0) {
 				ERR("could not allocate data block\n");
-				goto fail;
+				brelse(bh);
+				ret = block;
+				goto out;
 			}
 			block_map[block_index] = block;
 			mark_buffer_dirty(bh);
@@ -178,7 +347,8 @@ static void update_inode_block_map(struct inode *i, int logical_block, int phys_
 		brelse(bh);
 		if ((bh = __bread(sb->s_bdev, block, JAGUAR_BLOCK_SIZE)) == NULL) {
 			ERR("could not read indirect block\n");
-			goto fail;
+			ret = -EIO;
+			goto out;
 		}
 
 		block_map = (int *)bh->b_data;
@@ -187,16 +357,76 @@ static void update_inode_block_map(struct inode *i, int logical_block, int phys_
 	}
 
 	/* now we are at level 1 indirection */
-	block_map[index] = phys_block;
+	for (n = 0; n < count && index < JAGUAR_BLOCK_SIZE / 4; n++, index++)
+		block_map[index] = (phys_block + n) | flags;
 	mark_buffer_dirty(bh);
 	brelse(bh);
-	DBG("updated level 1 index %d with phys block\n", index);
+	DBG("updated %d level 1 entries with phys blocks\n", n);
+	ret = n;
 
 out:
 	if (save_inode)
 		mark_inode_dirty(i);
 fail:
-	return;
+	return ret;
+}
+
+/* map 'count' logical blocks starting at 'logical_block' to the
+ * contiguous physical blocks starting at 'phys_block'.
+ * the map is locked, as the end io worker updates it without i_mutex
+ * or any page lock.
+ */
+static int update_inode_block_map(struct inode *i, int logical_block, int phys_block,
+	int count, unsigned int flags)
+{
+	int n, ret = 0, start = logical_block, total = count;
+	unsigned int entry = phys_block | flags;
+	struct jaguar_inode *ji = (struct jaguar_inode *)i->i_private;
+
+	mutex_lock(&ji->map_mutex);
+	while (count > 0) {
+		if (ji->disk_copy.flags & INODE_FLG_EXTENTS)
+			n = jaguar_ext_map(i, logical_block, phys_block, count, flags);
+		else
+			n = map_inode_blocks(i, logical_block, phys_block, count, flags);
+		if (n < 0) {
+			/* the map may be half updated, forget the range */
+			entry = 0;
+			ret = n;
+			break;
+		}
+
+		logical_block += n;
+		phys_block += n;
+		count -= n;
+	}
+
+	jaguar_mcache_update(i, start, entry, total);
+	mutex_unlock(&ji->map_mutex);
+
+	return ret;
+}
+
+/* a run of new blocks could not be stored in the inode's map. the
+ * blocks the map took before it failed stay with the inode, the rest
+ * are freed.
+ */
+static void undo_alloc_run(struct inode *i, int logical_block, int block,
+	int count)
+{
+	int n;
+	unsigned int entry;
+	struct jaguar_free_batch fb;
+
+	free_batch_init(&fb, i->i_sb);
+	for (n = 0; n < count; n++) {
+		/* if the map cannot be read, leaking the block is safer */
+		if (lookup_blocks(i, logical_block + n, 1, &entry) < 0)
+			continue;
+		if ((entry & ~JAGUAR_UNWRITTEN) != block + n)
+			free_batch_add(&fb, block + n);
+	}
+	free_batch_finish(&fb);
 }
 
 static int read_inode_from_disk(struct inode *i)
@@ -212,7 +442,7 @@ static int read_inode_from_disk(struct inode *i)
 	DBG("read_inode_from_disk: entering, inum=%d\n", (int)i->i_ino);
 
 	/* calculate block and offset where inode is present */
-	block = BYTES_TO_BLOCK(jsb->disk_copy->inode_tbl_start) + INUM_TO_BLOCK(i->i_ino);
+	block = SB_LAYOUT_BLOCK(jsb->disk_copy, inode_tbl_start) + INUM_TO_BLOCK(i->i_ino);
 	offset = INUM_TO_OFFSET(i->i_ino);
 	//DBG("block = %d, offset = %d\n", block, offset);
 
@@ -245,10 +475,10 @@ int write_inode_to_disk(struct inode *i)
 	DBG("write_inode_to_disk: entering, inum=%d, size=%d\n", (int)i->i_ino, (int)i->i_size);
 
 	/* update some dynamic fields on the disk copy */
-	jid->size = i->i_size;
+	JAGUAR_SET_I_SIZE(jid, i->i_size);
 
 	/* calculate block and offset where inode is present */
-	block = BYTES_TO_BLOCK(jsb->disk_copy->inode_tbl_start) + INUM_TO_BLOCK(i->i_ino);
+	block = SB_LAYOUT_BLOCK(jsb->disk_copy, inode_tbl_start) + INUM_TO_BLOCK(i->i_ino);
 	offset = INUM_TO_OFFSET(i->i_ino);
 	//DBG("block = %d, offset = %d\n", block, offset);
 
@@ -259,6 +489,10 @@ int write_inode_to_disk(struct inode *i)
 		goto fail;
 	}
 
+	/* the orphan list links are owned by orphan.c, keep the disk's */
+	jid->next_orphan = ((struct jaguar_inode_on_disk *)(bh->b_data + offset))->next_orphan;
+	jid->prev_orphan = ((struct jaguar_inode_on_disk *)(bh->b_data + offset))->prev_orphan;
+
 	memcpy(bh->b_data + offset, jid, sizeof(*jid));
 	mark_buffer_dirty(bh);
 
@@ -270,10 +504,10 @@ fail:
 }
 
 
-static int alloc_inode(struct super_block *sb)
+static int alloc_inode(struct super_block *sb, int group)
 {
 	int ret = -1, inum;
-	int block, start, offset, bmap_size, bmap_start;
+	int block, offset;
 	struct jaguar_super_block *jsb;
 	struct jaguar_super_block_on_disk *jsbd;
 	struct buffer_head *bh = NULL;
@@ -287,13 +521,8 @@ static int alloc_inode(struct super_block *sb)
 		goto fail;
 	}
 
-	bmap_start = BYTES_TO_BLOCK(jsbd->inode_bmap_start);
-	bmap_size = BYTES_TO_BLOCK(jsbd->inode_bmap_size);
-	start = jsbd->next_free_inode / NUM_BITS_PER_BLOCK;
-
-	/* allocate an inode from the bitmap */
-	inum = jaguar_bmap_alloc_bit(sb->s_bdev, 
-		bmap_start, bmap_size, start);
+	/* allocate an inode from the group bitmaps */
+	inum = jaguar_group_alloc_inode(sb, group);
 	if (inum < 0) {
 		ERR("could not alloc inum\n");
 		ret = -ENOMEM;
@@ -301,13 +530,8 @@ static int alloc_inode(struct super_block *sb)
 	}
 	DBG("alloc_inode: found inum %d\n", inum);
 
-	/* update super block info */
-	jsbd->n_inodes_free--;
-	jsbd->next_free_inode = (inum + 1) % jsbd->n_inodes;
-	mark_buffer_dirty(jsb->bh);
-
 	/* zero out the allocated inode */
-	block = BYTES_TO_BLOCK(jsbd->inode_tbl_start) +
+	block = SB_LAYOUT_BLOCK(jsbd, inode_tbl_start) +
 		(inum / JAGUAR_NUM_INODES_PER_BLOCK);
 	if ((bh = __bread(sb->s_bdev, block, JAGUAR_BLOCK_SIZE)) == NULL) {
 		ERR("error reading inode table from disk\n");
@@ -326,42 +550,6 @@ fail:
 	return ret;
 }
 
-static int free_inode(struct inode *i)
-{
-	int ret = 0;
-	int bmap_start;
-	struct super_block *sb = i->i_sb;
-	struct jaguar_super_block *jsb;
-	struct jaguar_super_block_on_disk *jsbd;
-	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
-
-	jsb = sb->s_fs_info;
-	jsbd = jsb->disk_copy;
-
-	bmap_start = BYTES_TO_BLOCK(jsbd->inode_bmap_start);
-
-	/* clear out the inode info on disk */
-	memset(&ji->disk_copy, 0, sizeof(ji->disk_copy));
-	mark_inode_dirty(i);
-
-	/* update the inode bitmap */
-	ret = jaguar_bmap_free_bit(sb->s_bdev, bmap_start, i->i_ino);
-	if (ret < 0) {
-		ERR("error updating inode bitmap\n");
-		ret = -EIO;
-		goto fail;
-	}
-	DBG("free_inode: freed inode %d\n", (int)i->i_ino);
-
-	/* update super block info */
-	jsbd->n_inodes_free++;
-	mark_buffer_dirty(jsb->bh);
-
-fail:
-	return ret;
-}
-
-
 static int read_inode_data(struct inode *i, 
 		int pos, int size, void *data)
 {
@@ -424,9 +612,11 @@ static int write_inode_data(struct inode *i,
 	 */
 	block = logical_to_phys_block(i, logical_block);
 
-	/* if no block was allocated for this offset, allocate one now */
+	/* if no block was allocated for this offset, allocate one now,
+	 * close to the inode's other blocks.
+	 */
 	if (!block) {
-		block = alloc_data_block(i->i_sb);
+		block = alloc_data_block(i->i_sb, find_goal(i, logical_block));
 		if (block < 0) {
 			ERR("could not allocate data block\n");
 			ret = -ENOMEM;
@@ -434,7 +624,13 @@ static int write_inode_data(struct inode *i,
 		}
 
 		/* store the block in the inode */
-		update_inode_block_map(i, logical_block, block);
+		if (update_inode_block_map(i, logical_block, block, 1, 0)) {
+			ERR("could not update inode block map\n");
+			undo_alloc_run(i, logical_block, block, 1);
+			ret = -EIO;
+			goto fail;
+		}
+		ji->last_block = block;
 
 		save_inode = 1;
 	}
@@ -453,9 +649,10 @@ static int write_inode_data(struct inode *i,
 		 * so we manually do a open, release to make sure the
 		 * ver_meta_bh is loaded.
 		 */
-		jaguar_open(i, NULL);
-		version(NULL, i, logical_block, block);
-		jaguar_release(i, NULL);
+		if (jaguar_open(i, NULL) == 0) {
+			version(NULL, i, logical_block, block);
+			jaguar_release(i, NULL);
+		}
 	}
 
 	/* copy the data to be written at offset in buffer,
@@ -482,6 +679,303 @@ fail:
 }
 
 
+/* walks the dentries of a dir a block at a time. each dir block is
+ * mapped and read once, and its dentries are looked at in place.
+ */
+struct dir_iter
+{
+	struct inode *dir;
+	struct buffer_head *bh;		/* block being walked, or NULL */
+	int logical;			/* its logical block, -1 if none */
+	struct jaguar_dentry_on_disk hole;	/* an unmapped block reads as empty dentries */
+};
+
+static void dir_iter_init(struct dir_iter *it, struct inode *dir)
+{
+	it->dir = dir;
+	it->bh = NULL;
+	it->logical = -1;
+	memset(&it->hole, 0, sizeof(it->hole));
+}
+
+/* the dentry at 'pos', which must be below i_size. it stays valid till
+ * the next call. returns NULL if the dir block could not be read.
+ */
+static struct jaguar_dentry_on_disk *dir_iter_get(struct dir_iter *it, int pos)
+{
+	int logical = pos / JAGUAR_BLOCK_SIZE, block;
+
+	if (logical != it->logical) {
+		if (it->bh)
+			brelse(it->bh);
+		it->bh = NULL;
+		it->logical = logical;
+
+		if ((block = logical_to_phys_block(it->dir, logical)) != 0 &&
+		    (it->bh = __bread(it->dir->i_sb->s_bdev, block,
+				JAGUAR_BLOCK_SIZE)) == NULL) {
+			ERR("could not read dir block %d\n", block);
+			it->logical = -1;
+			return NULL;
+		}
+	}
+
+	if (it->bh == NULL)
+		return &it->hole;
+
+	return (struct jaguar_dentry_on_disk *)(it->bh->b_data + pos % JAGUAR_BLOCK_SIZE);
+}
+
+static void dir_iter_end(struct dir_iter *it)
+{
+	if (it->bh)
+		brelse(it->bh);
+	it->bh = NULL;
+}
+
+/* forget the free slots of a dir. they are looked up again when needed */
+static void dir_slots_drop(struct jaguar_inode *ji)
+{
+	kfree(ji->free_slots);
+	ji->free_slots = NULL;
+	ji->n_free_slots = 0;
+	ji->max_free_slots = 0;
+}
+
+/* a dentry slot was freed. if the stack cannot grow, it is dropped */
+static void dir_slot_put(struct jaguar_inode *ji, int slot)
+{
+	int *slots;
+
+	if (ji->n_free_slots == ji->max_free_slots) {
+		slots = krealloc(ji->free_slots,
+			2 * ji->max_free_slots * sizeof(int), GFP_NOFS);
+		if (slots == NULL) {
+			dir_slots_drop(ji);
+			return;
+		}
+		ji->free_slots = slots;
+		ji->max_free_slots *= 2;
+	}
+
+	ji->free_slots[ji->n_free_slots++] = slot;
+}
+
+/* the position for a new dentry: a free slot, or the end of the dir.
+ * the free slots are collected by a scan of the dir the first time.
+ * lower slots are handed out first.
+ */
+static int dir_slot_get(struct inode *dir)
+{
+	int pos;
+	struct jaguar_inode *ji = (struct jaguar_inode *) dir->i_private;
+	struct jaguar_dentry_on_disk *jd;
+	struct dir_iter it;
+
+	if (ji->free_slots == NULL) {
+		if ((ji->free_slots = kmalloc(16 * sizeof(int), GFP_NOFS)) == NULL)
+			return -ENOMEM;
+		ji->max_free_slots = 16;
+
+		dir_iter_init(&it, dir);
+		for (pos = dir->i_size - sizeof(*jd); pos >= 0 && ji->free_slots;
+		     pos -= sizeof(*jd)) {
+			if ((jd = dir_iter_get(&it, pos)) == NULL) {
+				dir_iter_end(&it);
+				dir_slots_drop(ji);
+				return -EIO;
+			}
+			if (jd->inum == 0)
+				dir_slot_put(ji, pos / sizeof(*jd));
+		}
+		dir_iter_end(&it);
+	}
+
+	if (ji->n_free_slots == 0)
+		return dir->i_size;
+
+	return ji->free_slots[--ji->n_free_slots] * sizeof(*jd);
+}
+
+/* free the blocks of a dir from 'logical_block' to its end */
+static int free_dir_tail(struct inode *i, int logical_block)
+{
+	int l, end, block, ret = 0;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+	struct jaguar_free_batch fb;
+	struct buffer_head *bh;
+
+	end = (i->i_size + JAGUAR_BLOCK_SIZE - 1) / JAGUAR_BLOCK_SIZE;
+	if (logical_block >= end)
+		return 0;
+
+	DBG("free_dir_tail: inum=%d, blocks %d to %d\n",
+		(int)i->i_ino, logical_block, end - 1);
+
+	free_batch_init(&fb, i->i_sb);
+
+	if (ji->disk_copy.flags & INODE_FLG_EXTENTS) {
+		ret = jaguar_ext_truncate(i, logical_block, &fb);
+		jaguar_mcache_update(i, logical_block, 0, end - logical_block);
+	} else {
+		/* emptied indirect blocks stay till the dir is deleted */
+		for (l = logical_block; l < end && !ret; l++) {
+			if ((block = logical_to_phys_block(i, l)) == 0)
+				continue;
+
+			/* the dentries in the buffer must not reach the disk
+			 * once the block belongs to someone else.
+			 */
+			if ((bh = __find_get_block(i->i_sb->s_bdev, block,
+					JAGUAR_BLOCK_SIZE)) != NULL)
+				bforget(bh);
+
+			if ((ret = update_inode_block_map(i, l, 0, 1, 0)) == 0)
+				ret = free_batch_add(&fb, block);
+		}
+	}
+
+	if (free_batch_finish(&fb) && !ret)
+		ret = -EIO;
+
+	return ret;
+}
+
+/* drop the empty dentries at the end of a dir, and free the blocks left
+ * with none. '.' and '..' always stay.
+ */
+static int shrink_dir(struct inode *i)
+{
+	int pos, size, n, k, ret;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+	struct jaguar_dentry_on_disk *jd;
+	struct dir_iter it;
+
+	dir_iter_init(&it, i);
+	for (pos = i->i_size - sizeof(*jd); pos >= 2 * (int)sizeof(*jd);
+	     pos -= sizeof(*jd)) {
+		if ((jd = dir_iter_get(&it, pos)) == NULL) {
+			dir_iter_end(&it);
+			return -EIO;
+		}
+		if (jd->inum)
+			break;
+	}
+	dir_iter_end(&it);
+
+	size = pos + sizeof(*jd);
+	if (size >= i->i_size)
+		return 0;
+
+	DBG("shrink_dir: inum=%d, size %d to %d\n", (int)i->i_ino,
+		(int)i->i_size, size);
+
+	ret = free_dir_tail(i, (size + JAGUAR_BLOCK_SIZE - 1) / JAGUAR_BLOCK_SIZE);
+
+	i->i_size = size;
+	ji->disk_copy.size = size;
+	mark_inode_dirty(i);
+
+	/* the free slots past the new end are gone */
+	for (n = k = 0; k < ji->n_free_slots; k++) {
+		if (ji->free_slots[k] * (int)sizeof(*jd) < size)
+			ji->free_slots[n++] = ji->free_slots[k];
+	}
+	ji->n_free_slots = n;
+
+	return ret;
+}
+
+/* move the live dentries at the end of a dir into the free slots near
+ * its start, then shrink it. the moves are written with
+ * write_inode_data(), so the blocks of a versioned dir are versioned
+ * as for any other change. open readers of the dir may see an entry
+ * twice, or miss it. called with the i_mutex of the dir held.
+ */
+int compact_dir(struct inode *i)
+{
+	int lo, hi, ret = 0;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+	struct jaguar_dentry_on_disk jd, *p = NULL;
+	struct dir_iter lo_it, hi_it;
+
+	DBG("compact_dir: entering, inum=%d, size=%d\n",
+		(int)i->i_ino, (int)i->i_size);
+
+	lo = 2 * sizeof(jd);
+	hi = i->i_size - sizeof(jd);
+	dir_iter_init(&lo_it, i);
+	dir_iter_init(&hi_it, i);
+
+	while (1) {
+		/* the first free slot, and the last live dentry */
+		for (; lo < hi; lo += sizeof(jd)) {
+			if ((p = dir_iter_get(&lo_it, lo)) == NULL || p->inum == 0)
+				break;
+		}
+		for (; p && hi > lo; hi -= sizeof(jd)) {
+			if ((p = dir_iter_get(&hi_it, hi)) == NULL || p->inum)
+				break;
+		}
+		if (p == NULL) {
+			ERR("error reading dir %d\n", (int)i->i_ino);
+			ret = -EIO;
+			break;
+		}
+		if (lo >= hi)
+			break;
+
+		memcpy(&jd, p, sizeof(jd));
+		if ((ret = write_inode_data(i, lo, sizeof(jd), &jd)))
+			break;
+		if (ji->disk_copy.dir_index) {
+			jaguar_dx_remove(i, jd.name, hi / sizeof(jd));
+			if (ji->disk_copy.dir_index)
+				jaguar_dx_add(i, jd.name, lo / sizeof(jd));
+		}
+
+		memset(&jd, 0, sizeof(jd));
+		if ((ret = write_inode_data(i, hi, sizeof(jd), &jd)))
+			break;
+
+		lo += sizeof(jd);
+		hi -= sizeof(jd);
+	}
+
+	dir_iter_end(&lo_it);
+	dir_iter_end(&hi_it);
+
+	/* all free slots are at the end now */
+	dir_slots_drop(ji);
+
+	if (!ret)
+		ret = shrink_dir(i);
+
+	return ret;
+}
+
+/* the DT_xxx of a dentry for filldir. dentries of a fs made before
+ * JAGUAR_FEATURE_FILETYPE may have junk in file_type, so it is not
+ * trusted there.
+ */
+static unsigned char dentry_dt_type(struct super_block *sb,
+	struct jaguar_dentry_on_disk *jd)
+{
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+
+	if (!(jsb->disk_copy->features & JAGUAR_FEATURE_FILETYPE))
+		return DT_UNKNOWN;
+
+	switch (jd->file_type) {
+	case INODE_TYPE_FILE:
+		return DT_REG;
+	case INODE_TYPE_DIR:
+		return DT_DIR;
+	}
+
+	return DT_UNKNOWN;
+}
+
 /* This is called by getdents syscall, which is called by ls.
  * Supposed to read from the filp->f_pos offset of the directory file,
  * and fill in dirent entries using the filldir callback fn.
@@ -496,25 +990,29 @@ static int jaguar_readdir(struct file *filp, void *dirent, filldir_t filldir)
 {
 	int done = 0;
 	struct inode *i = filp->f_dentry->d_inode;
-	struct jaguar_dentry_on_disk jd;
+	struct jaguar_dentry_on_disk *jd;
+	struct dir_iter it;
 
 	DBG("jaguar_readdir: entering, inum=%d, pos=%d, isize=%d\n", 
 		(int)i->i_ino, (int)filp->f_pos, (int)i->i_size);
 
 	/* read the dir entries from the disk */
+	dir_iter_init(&it, i);
 	while (filp->f_pos < i->i_size) {
 
-		/* read a dentry from disk */
-		if (read_inode_data(i, (int)filp->f_pos, sizeof(jd), &jd) < 0) {
+		/* the dentry, straight from the dir block */
+		if ((jd = dir_iter_get(&it, (int)filp->f_pos)) == NULL) {
 			ERR("error reading dentry from disk\n");
 			goto out;
 		}
 
 		/* inum 0 is a deleted entry */
-		if (jd.inum > 0) {
+		if (jd->inum > 0) {
 			/* pass the contents to the caller */
-			//DBG("calling filldir with name=[%s], inum=%d\n", jd.name, jd.inum);
-			done = filldir(dirent, jd.name, strlen(jd.name), 0, jd.inum, DT_UNKNOWN);
+			//DBG("calling filldir with name=[%s], inum=%d\n", jd->name, jd->inum);
+			done = filldir(dirent, jd->name,
+				strnlen(jd->name, JAGUAR_FILENAME_MAX - 1), 0,
+				jd->inum, dentry_dt_type(i->i_sb, jd));
 
 			if (done) {
 				/* caller says no more buffer space */
@@ -523,10 +1021,11 @@ static int jaguar_readdir(struct file *filp, void *dirent, filldir_t filldir)
 			}
 		}
 
-		filp->f_pos += sizeof(jd);
+		filp->f_pos += sizeof(*jd);
 	}
 
 out:
+	dir_iter_end(&it);
 	//DBG("jaguar_readdir: leaving\n");
 	return 0;
 }	
@@ -534,18 +1033,27 @@ out:
 static int create_file_dir(struct inode *parent, 
 		struct dentry *d, int type, struct inode **newinode)
 {
-	int inum, ret = 0, pos;
+	int inum, group, ret = 0, pos;
 	struct inode *i;
-	struct jaguar_dentry_on_disk jd;
+	struct jaguar_super_block *jsb = parent->i_sb->s_fs_info;
+	struct jaguar_dentry_on_disk jd, *pjd;
 	struct jaguar_inode *ji, *ji_parent;
 	struct jaguar_inode_on_disk *jid, *jid_parent;
 	struct version_info vinfo;
+	struct dir_iter it;
 
 	DBG("create_file_dir: entering: name=%s, type=%d\n", 
 			d->d_name.name, type);
 
-	/* alloc a new inode on disk */
-	inum = alloc_inode(parent->i_sb);
+	/* alloc a new inode on disk.
+	 * files go in the group of their parent dir, so that readdir and
+	 * stat over a dir stay local. dirs are spread over the groups.
+	 */
+	if (type == INODE_TYPE_DIR)
+		group = jaguar_group_for_dir(parent->i_sb);
+	else
+		group = INUM_TO_GROUP(parent->i_ino);
+	inum = alloc_inode(parent->i_sb, group);
 	if (inum < 0) {
 		ERR("could not allocate inode on disk\n");
 		ret = -ENOMEM;
@@ -567,6 +1075,19 @@ static int create_file_dir(struct inode *parent,
 	/* if parent dir was versioned, set it on child too */
 	ji_parent = (struct jaguar_inode *) parent->i_private;
 	jid_parent = &ji_parent->disk_copy;
+
+	/* a new file's data goes right after its parent dir's block */
+	if (type == INODE_TYPE_FILE)
+		ji->last_block = logical_to_phys_block(parent, 0);
+
+	/* new files start with their data inline, if the fs allows it.
+	 * other new inodes map their blocks with extents, if the fs has them.
+	 */
+	if (type == INODE_TYPE_FILE &&
+	    (jsb->disk_copy->features & JAGUAR_FEATURE_INLINE_DATA))
+		jid->flags |= INODE_FLG_INLINE;
+	else if (jsb->disk_copy->features & JAGUAR_FEATURE_EXTENTS)
+		jaguar_ext_init(jid);
 	if (jid_parent->version_type != 0) {
 		vinfo.type = jid_parent->version_type;
 		vinfo.param = jid_parent->version_param;
@@ -584,18 +1105,10 @@ static int create_file_dir(struct inode *parent,
 	}
 
 	/* find a new empty dentry under the parent dir */
-	pos = 0;
-	while (pos < parent->i_size) {
-		if (read_inode_data(parent, pos, sizeof(jd), &jd) < 0) {
-			ERR("error reading dentry at offset %d\n", pos);
-			ret = -EIO;
-			goto fail;
-		}
-
-		if (jd.inum == 0)
-			break;
-
-		pos += sizeof(jd);
+	if ((pos = dir_slot_get(parent)) < 0) {
+		ERR("error looking for a free dentry\n");
+		ret = pos;
+		goto fail;
 	}
 
 
@@ -604,15 +1117,26 @@ static int create_file_dir(struct inode *parent,
 	 * pointed by pos with d->d_name.name and inum, and save it.
 	 */
 	//DBG("new dentry at pos=%d\n", pos);
+	memset(&jd, 0, sizeof(jd));
 	jd.inum = inum;
-	BUG_ON(strlen(d->d_name.name) >= JAGUAR_FILENAME_MAX);
-	strcpy(jd.name, d->d_name.name);
+	if (jsb->disk_copy->features & JAGUAR_FEATURE_FILETYPE)
+		jd.file_type = type;
+	BUG_ON(d->d_name.len > JAGUAR_NAME_LEN(jsb->disk_copy));
+	memcpy(jd.name, d->d_name.name, d->d_name.len);
 	if (write_inode_data(parent, pos, sizeof(jd), &jd)) {
 		ERR("error writing out new dentry\n");
+		if (pos < parent->i_size)
+			dir_slot_put(ji_parent, pos / sizeof(jd));
 		ret = -EIO;
 		goto fail;
 	}
 
+	/* keep the dir index up to date, or build one once the dir is big */
+	if (jid_parent->dir_index)
+		jaguar_dx_add(parent, jd.name, pos / sizeof(jd));
+	else if (parent->i_size >= JAGUAR_DX_MIN_BLOCKS * JAGUAR_BLOCK_SIZE)
+		jaguar_dx_build(parent);
+
 	/* update the parent's nlink and save it on disk */
 	inode_inc_link_count(parent);
 	ji = (struct jaguar_inode *) parent->i_private;
@@ -641,10 +1165,10 @@ fail:
 
 }
 
-static int free_indirect_block(struct inode *inode, int block, int level)
+static int free_indirect_block(struct super_block *sb, int block, int level,
+	struct jaguar_free_batch *fb)
 {
 	int ret = 0, i, *block_map;
-	struct super_block *sb = inode->i_sb;
 	struct buffer_head *bh = NULL;
 
 	DBG("free_indirect_block: entering, level=%d\n", level);
@@ -657,14 +1181,24 @@ static int free_indirect_block(struct inode *inode, int block, int level)
 	}
 	block_map = (int *)bh->b_data;
 
+	/* the lower level indirect blocks are read one after the other
+	 * below. start reading all of them now.
+	 */
+	if (level > 1) {
+		for (i = 0; i < JAGUAR_BLOCK_SIZE / 4; i++) {
+			if (block_map[i])
+				__breadahead(sb->s_bdev, block_map[i], JAGUAR_BLOCK_SIZE);
+		}
+	}
+
 	for (i = 0; i < JAGUAR_BLOCK_SIZE / 4; i++) {
 		if (block_map[i] == 0)
 			continue;
 
 		if (level == 1)
-			ret = free_data_block(inode->i_sb, block_map[i]);
+			ret = free_batch_add(fb, block_map[i] & ~JAGUAR_UNWRITTEN);
 		else
-			ret = free_indirect_block(inode, block_map[i], level-1);
+			ret = free_indirect_block(sb, block_map[i], level-1, fb);
 
 		if (ret)
 			goto out;
@@ -673,7 +1207,7 @@ static int free_indirect_block(struct inode *inode, int block, int level)
 	/* all data blocks in lower levels have been freed.
 	 * now free this indirect block.
 	 */
-	ret = free_data_block(inode->i_sb, block);
+	ret = free_batch_add(fb, block);
 out:
 	if (bh)
 		brelse(bh);
@@ -681,15 +1215,20 @@ out:
 	return ret;
 }
 
-static int free_all_data_blocks(struct inode *inode)
+/* free all data, indirect and version blocks of an on-disk inode.
+ * called by the orphan worker, once the inode is no longer in use.
+ */
+int free_inode_blocks(struct super_block *sb, struct jaguar_inode_on_disk *jid)
 {
-	int n_blocks, ret = 0, block, i, n_blocks_freed = 0, level;
-	struct jaguar_inode *ji = (struct jaguar_inode *)inode->i_private;
-	struct jaguar_inode_on_disk *jid = &ji->disk_copy;
-	int max_blks_at_level[] = { 12, 1024, 1048576 };
+	int ret = 0, block, i, level;
+	struct jaguar_free_batch fb;
 
-	n_blocks = (inode->i_size + JAGUAR_BLOCK_SIZE - 1 ) / JAGUAR_BLOCK_SIZE;
-	DBG("free_all_data_blocks: freeing %d blocks\n", n_blocks);
+	DBG("free_inode_blocks: entering, size=%lld\n", JAGUAR_I_SIZE(jid));
+
+	/* the blocks are collected in a batch, and freed a bitmap block
+	 * at a time at the end.
+	 */
+	free_batch_init(&fb, sb);
 
 	/* if file/dir is versioned, then free the ver meta block.
 	 * actually, there might be more ver meta blocks linked together,
@@ -699,92 +1238,121 @@ static int free_all_data_blocks(struct inode *inode)
 	 * but for now, only the latest ver meta block is freed.
 	 */
 	if (jid->version_type != 0 && jid->ver_meta_block != 0)
-		free_data_block(inode->i_sb, jid->ver_meta_block);
+		free_batch_add(&fb, jid->ver_meta_block);
+
+	if (jid->dir_index && (ret = jaguar_dx_free(sb, jid, &fb)))
+		goto out;
+
+	/* inline data, no blocks */
+	if (jid->flags & INODE_FLG_INLINE)
+		goto out;
+
+	if (jid->flags & INODE_FLG_EXTENTS) {
+		ret = jaguar_ext_free(sb, jid, &fb);
+		goto out;
+	}
 
-	i = 0;
-	while (n_blocks_freed < n_blocks) {
+	/* all slots are looked at, not just those below i_size, since
+	 * fallocate with FALLOC_FL_KEEP_SIZE maps blocks past the end.
+	 */
+	for (i = 0; i < JAGUAR_INODE_NUM_BLOCK_ENTRIES; i++) {
 
-		block = ji->disk_copy.blocks[i];
+		block = jid->blocks[i] & ~JAGUAR_UNWRITTEN;
 		level = (i < 12) ? 0 : i - 11;
 
-		if (level == 0) {
+		if (!block) {
+			/* hole, nothing allocated here */
+			continue;
+		} else if (level == 0) {
 			/* direct block, simply free */
-			ret = free_data_block(inode->i_sb, block);
-			n_blocks_freed++;
+			ret = free_batch_add(&fb, block);
 		} else {
 			/* indirect block, recursive free */
-			ret = free_indirect_block(inode, block, level);
-			n_blocks_freed += max_blks_at_level[level];
+			ret = free_indirect_block(sb, block, level, &fb);
 		}
 
 		if (ret)
 			break;
-
-		i++;
 	}
 
+out:
+	if (free_batch_finish(&fb) && !ret)
+		ret = -EIO;
+
 	return ret;
 }
 
 static int unlink_file_dir(struct inode *parent, struct dentry *d)
 {
-	int ret = 0, pos;
+	int ret = 0, pos, slot;
 	struct inode *i = d->d_inode;
-	struct jaguar_dentry_on_disk jd;
-	struct jaguar_inode *ji;
+	struct jaguar_dentry_on_disk jd, *pjd;
+	struct jaguar_inode *ji = (struct jaguar_inode *) parent->i_private;
+	struct dir_iter it;
 
 	DBG("unlink_file_dir: entering: name=%s\n", d->d_name.name);
 
-	/* free all data blocks associated with inode */
-	if (free_all_data_blocks(i)) {
-		ERR("could not free all data blocks on disk\n");
-		ret = -EIO;
-		goto fail;
-	}
-
-	/* free the inode on disk */
-	if (free_inode(i)) {
-		ERR("could not free inode on disk\n");
-		ret = -EIO;
-		goto fail;
-	}
-
-	/* find the dentry under the parent dir */
+	/* find the dentry under the parent dir. if the dir has an index,
+	 * the scan starts right at the dentry.
+	 */
 	pos = 0;
+	if (ji->disk_copy.dir_index &&
+	    jaguar_dx_lookup(parent, d->d_name.name, &slot) > 0)
+		pos = slot * sizeof(jd);
+
+	dir_iter_init(&it, parent);
 	while (pos < parent->i_size) {
-		if (read_inode_data(parent, pos, sizeof(jd), &jd) < 0) {
+		if ((pjd = dir_iter_get(&it, pos)) == NULL) {
 			ERR("error reading dentry at offset %d\n", pos);
+			dir_iter_end(&it);
 			ret = -EIO;
 			goto fail;
 		}
 
-		if (strcmp(d->d_name.name, jd.name) == 0) {
+		if (strcmp(d->d_name.name, pjd->name) == 0) {
 			break;
 		}
 
 		pos += sizeof(jd);
 	}
+	dir_iter_end(&it);
 
 	/* remove the dentry of inode from the parent dir */
-	jd.inum = 0;
-	memset(jd.name, 0, sizeof(jd.name));
+	memset(&jd, 0, sizeof(jd));
 	if (write_inode_data(parent, pos, sizeof(jd), &jd)) {
 		ERR("error clearing out dentry\n");
 		ret = -EIO;
 		goto fail;
 	}
 
+	if (ji->disk_copy.dir_index)
+		jaguar_dx_remove(parent, d->d_name.name, pos / sizeof(jd));
+	if (ji->free_slots)
+		dir_slot_put(ji, pos / sizeof(jd));
+
+	/* the last dentry went, the dir gets shorter */
+	if (pos + sizeof(jd) >= parent->i_size)
+		shrink_dir(parent);
+
 	/* update the parent's nlink and save it on disk */
 	inode_dec_link_count(parent);
 	ji = (struct jaguar_inode *) parent->i_private;
 	ji->disk_copy.nlink--;
 	mark_inode_dirty(parent);
 
-	/* decrement child's nlink. no need to update on disk, since
-	 * it has already been freed. but the decrement is required,
-	 * otherwise the inode may never be removed from the inode cache.
+	/* the inode and its blocks are not freed here. the inode goes on
+	 * the orphan list, and is freed in the background once the last
+	 * reference to it is dropped (see jaguar_evict_inode).
 	 */
-	inode_dec_link_count(i);
+	ji = (struct jaguar_inode *) i->i_private;
+	ji->disk_copy.nlink = 0;
+	clear_nlink(i);
+	mark_inode_dirty(i);
+	if (jaguar_orphan_add(i)) {
+		ERR("could not add inode %d to orphan list\n", (int)i->i_ino);
+		ret = -EIO;
+		goto fail;
+	}
 	DBG("i->i_nlink=%d\n", i->i_nlink);
 fail:
 	return ret;
@@ -806,6 +1374,7 @@ static int jaguar_mkdir(struct inode *parent, struct dentry *d, umode_t mode)
 	pos = 0;
 	memset(&jd, 0, sizeof(jd));
 	jd.inum = i->i_ino;
+	jd.file_type = INODE_TYPE_DIR;
 	strcpy(jd.name, ".");
 	if (write_inode_data(i, pos, sizeof(jd), &jd)) {
 		ERR("error writing dentry for .\n");
@@ -815,6 +1384,7 @@ static int jaguar_mkdir(struct inode *parent, struct dentry *d, umode_t mode)
 	pos += sizeof(jd);
 	memset(&jd, 0, sizeof(jd));
 	jd.inum = parent->i_ino;
+	jd.file_type = INODE_TYPE_DIR;
 	strcpy(jd.name, "..");
 	if (write_inode_data(i, pos, sizeof(jd), &jd)) {
 		ERR("error writing dentry for ..\n");
@@ -840,26 +1410,47 @@ static int jaguar_rmdir(struct inode *parent, struct dentry *d)
  */
 static struct dentry *jaguar_lookup(struct inode *parent, struct dentry *d, struct nameidata *data)
 {
-	int pos = 0, ret = 0;
-	struct jaguar_dentry_on_disk jd;
+	int pos = 0, ret = 0, inum;
+	struct jaguar_dentry_on_disk *jd;
+	struct jaguar_inode *ji = (struct jaguar_inode *) parent->i_private;
+	struct jaguar_super_block *jsb = parent->i_sb->s_fs_info;
 	struct inode *i;
+	struct dir_iter it;
 
 	DBG("jaguar_lookup: entering, name=%s\n", d->d_name.name);
 
+	if (d->d_name.len > JAGUAR_NAME_LEN(jsb->disk_copy))
+		return ERR_PTR(-ENAMETOOLONG);
+
+	/* a big dir finds the name through its index. an index that cannot
+	 * be read is dropped, and the dir is scanned instead.
+	 */
+	if (ji->disk_copy.dir_index) {
+		if ((inum = jaguar_dx_lookup(parent, d->d_name.name, &pos)) >= 0) {
+			if (inum > 0)
+				d_add(d, jaguar_iget(parent->i_sb, inum));
+			goto fail;
+		}
+		ERR("dir %d: bad index, scanning the dir\n", (int)parent->i_ino);
+		jaguar_dx_drop(parent);
+		pos = 0;
+	}
+
+	dir_iter_init(&it, parent);
 	while (pos < parent->i_size) {
-		/* read a dentry */
-		if (read_inode_data(parent, pos, sizeof(jd), &jd) < 0) {
+		/* get a dentry */
+		if ((jd = dir_iter_get(&it, pos)) == NULL) {
 			ERR("error reading dentry at offset %d\n", pos);
 			ret = -EIO;
-			goto fail;
+			break;
 		}
 
-		//DBG("comparing dentry %s with %s\n", jd.name, d->d_name.name);
-		if (strcmp(d->d_name.name, jd.name) == 0) {
+		//DBG("comparing dentry %s with %s\n", jd->name, d->d_name.name);
+		if (strcmp(d->d_name.name, jd->name) == 0) {
 
-			//DBG("match found... mapping %s to inode %d\n", d->d_name.name, jd.inum);
+			//DBG("match found... mapping %s to inode %d\n", d->d_name.name, jd->inum);
 			/* get an inode */
-			i = jaguar_iget(parent->i_sb, jd.inum);
+			i = jaguar_iget(parent->i_sb, jd->inum);
 			//DBG("inum=%d, count=%d\n", (int)i->i_ino, atomic_read(&i->i_count));
 
 			/* associate given dentry with the inode */
@@ -869,9 +1460,9 @@ static struct dentry *jaguar_lookup(struct inode *parent, struct dentry *d, stru
 			break;
 		}
 
-		pos += sizeof(jd);
+		pos += sizeof(*jd);
 	}
-
+	dir_iter_end(&it);
 
 fail:
 	//DBG("jaguar_lookup: leaving\n");
@@ -911,7 +1502,7 @@ int alloc_version_meta_block(struct inode *i)
 	old_ver_meta_block = jid->ver_meta_block;
 
 	/* alloc a new data block for version metadata */
-	if ((jid->ver_meta_block = alloc_data_block(sb)) < 0) {
+	if ((jid->ver_meta_block = alloc_data_block(sb, find_version_goal(i))) < 0) {
 		ERR("could not allocate data block\n");
 		return -ENOMEM;
 		goto fail;
@@ -945,13 +1536,41 @@ fail:
 	return ret;
 }
 
+/* read a block of file data into 'buf', through the page cache.
+ * unlike do_sync_read(), this also works for a file opened with
+ * O_DIRECT, whose reads cannot go to a kernel buffer.
+ * returns the num of bytes of the block within the file, 0 if it is
+ * past the end.
+ */
+static int read_file_block(struct file *filp, struct inode *i,
+		int logical_block, char *buf)
+{
+	loff_t pos = (loff_t)logical_block * JAGUAR_BLOCK_SIZE;
+	struct page *page;
+	void *kaddr;
+
+	if (pos >= i_size_read(i))
+		return 0;
+
+	page = read_mapping_page(i->i_mapping, logical_block, filp);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+
+	kaddr = kmap(page);
+	memcpy(buf, kaddr, JAGUAR_BLOCK_SIZE);
+	kunmap(page);
+	page_cache_release(page);
+
+	return min_t(loff_t, i_size_read(i) - pos, JAGUAR_BLOCK_SIZE);
+}
+
 /*
  * filp			: valid only when files are versioned
  * i			: valid always
  * logical_block	: valid for files and dirs
  * phys_block		: valid only for dirs
  */
-static void version(struct file *filp, struct inode *i, int logical_block, int phys_block)
+static void __version(struct file *filp, struct inode *i, int logical_block, int phys_block)
 {
 	struct buffer_head *ver_bh, *bh = NULL;
 	struct super_block *sb;
@@ -961,8 +1580,6 @@ static void version(struct file *filp, struct inode *i, int logical_block, int p
 	int ver_block, ret;
 	struct timeval tv;
 	char *data;
-	loff_t readpos;
-	mm_segment_t oldfs;
 
 	DBG("version: entering: inum=%d, logical=%d\n",
 		(int)i->i_ino, logical_block);
@@ -997,12 +1614,8 @@ static void version(struct file *filp, struct inode *i, int logical_block, int p
 	 *    using phys_block
 	 */
 	if (filp) {
-		readpos = logical_block * JAGUAR_BLOCK_SIZE;
-		oldfs = get_fs();
-		set_fs(KERNEL_DS);
-		ret = do_sync_read(filp, ji->ver_data_buf, JAGUAR_BLOCK_SIZE, &readpos);
-		set_fs(oldfs);
-		DBG("do_sync_read returned %d, buf[0]=%c\n", ret, ji->ver_data_buf[0]);
+		ret = read_file_block(filp, i, logical_block, ji->ver_data_buf);
+		DBG("read_file_block returned %d, buf[0]=%c\n", ret, ji->ver_data_buf[0]);
 		if (ret <= 0)
 			goto fail;
 		data = ji->ver_data_buf;
@@ -1015,7 +1628,7 @@ static void version(struct file *filp, struct inode *i, int logical_block, int p
 	}
 
 	/* allocate a new version data block to store old data */
-	if ((ver_block = alloc_data_block(sb)) < 0) {
+	if ((ver_block = alloc_data_block(sb, find_version_goal(i))) < 0) {
 		ERR("could not allocate version data block\n");
 		goto fail;
 	}
@@ -1040,8 +1653,8 @@ static void version(struct file *filp, struct inode *i, int logical_block, int p
 	jvme = &jvm->entry[jvm->num_entries];
 	jvme->logical_block = logical_block;
 	jvme->version_block = ver_block;
-	if (i->i_size < (logical_block+1)*JAGUAR_BLOCK_SIZE)
-		jvme->bytes_valid = i->i_size - (logical_block * JAGUAR_BLOCK_SIZE);
+	if (i->i_size < ((loff_t)logical_block + 1) * JAGUAR_BLOCK_SIZE)
+		jvme->bytes_valid = i->i_size - ((loff_t)logical_block * JAGUAR_BLOCK_SIZE);
 	else
 		jvme->bytes_valid = JAGUAR_BLOCK_SIZE;
 	jvme->timestamp = tv.tv_sec;
@@ -1067,6 +1680,18 @@ fail:
 	return;
 }
 
+/* a file is versioned from write(), and from page faults on a shared
+ * mapping, which may run at the same time.
+ */
+static void version(struct file *filp, struct inode *i, int logical_block, int phys_block)
+{
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+
+	mutex_lock(&ji->ver_mutex);
+	__version(filp, i, logical_block, phys_block);
+	mutex_unlock(&ji->ver_mutex);
+}
+
 int retrieve(struct file *filp, int logical_block, int at, char __user *data)
 {
 	struct jaguar_version_metadata *jvm = NULL;
@@ -1159,7 +1784,7 @@ int retrieve(struct file *filp, int logical_block, int at, char __user *data)
 		 * and NOT updated on disk, we MUST use vfs_read.
 		 */
 		DBG("no version data block, returning latest data\n");
-		pos = logical_block * JAGUAR_BLOCK_SIZE;
+		pos = (loff_t)logical_block * JAGUAR_BLOCK_SIZE;
 		if (jid->type == INODE_TYPE_FILE) {
 			return vfs_read(filp, data, JAGUAR_BLOCK_SIZE, &pos);
 		} else {
@@ -1204,6 +1829,7 @@ int prune(struct file *filp)
 	struct inode *i;
 	struct super_block *sb;
 	struct timeval tv;
+	struct jaguar_free_batch fb;
 
 	i = filp->f_dentry->d_inode;
 	sb = i->i_sb;
@@ -1221,6 +1847,8 @@ int prune(struct file *filp)
 	if (jid->version_type == JAGUAR_KEEP_ALL)
 		return 0;
 
+	free_batch_init(&fb, sb);
+
 	while (!done) {
 
 		jvm = (struct jaguar_version_metadata *) ver_meta_bh->b_data;
@@ -1247,7 +1875,7 @@ int prune(struct file *filp)
 				/* this entry should be pruned.
 				 * free the version data block
 				 */
-				free_data_block(sb, jvme->version_block);
+				free_batch_add(&fb, jvme->version_block);
 				
 				/* update the start entry for this version
 				 * block. note that this should happen only
@@ -1285,7 +1913,7 @@ int prune(struct file *filp)
 
 		if (free_meta_block) {
 			DBG("freeing meta block %d\n", cur_meta_block);
-			free_data_block(sb, cur_meta_block);
+			free_batch_add(&fb, cur_meta_block);
 		}
 
 		if (next_meta_block) {
@@ -1314,6 +1942,7 @@ int prune(struct file *filp)
 	}
 
 fail:
+	free_batch_finish(&fb);
 	return 0;
 }
 
@@ -1338,6 +1967,12 @@ int rollback_dir(struct inode *i, int offset, int nbytes, char __user *data)
 
 	__copy_from_user(buf, data, JAGUAR_BLOCK_SIZE);
 
+	/* the old dentries do not match the index, or the free slots, any
+	 * more.
+	 */
+	jaguar_dx_drop(i);
+	dir_slots_drop((struct jaguar_inode *) i->i_private);
+
 	ret = write_inode_data(i, offset, nbytes, buf);
 
 	i->i_size = offset + nbytes;
@@ -1348,10 +1983,54 @@ int rollback_dir(struct inode *i, int offset, int nbytes, char __user *data)
 	return ret;
 }
 
+/* the data written to logical blocks [logical_block, logical_block +
+ * count) reached the disk. the unwritten blocks among them are marked
+ * as holding data. until then they read as zeros, so a crash before the
+ * write completes never shows what they held before they were freed.
+ */
+static int convert_unwritten(struct inode *i, int logical_block, int count)
+{
+	int n, ret = 0;
+	unsigned int entry;
+
+	DBG("convert_unwritten: inum=%d, logical=%d, count=%d\n",
+		(int)i->i_ino, logical_block, count);
+
+	while (count > 0) {
+		if ((n = lookup_blocks(i, logical_block, count, &entry)) <= 0) {
+			ret = n ? n : -EIO;
+			break;
+		}
+
+		if ((entry & JAGUAR_UNWRITTEN) && (ret = update_inode_block_map(i,
+				logical_block, entry & ~JAGUAR_UNWRITTEN, n, 0)))
+			break;
+
+		logical_block += n;
+		count -= n;
+	}
+
+	if (ret)
+		ERR("could not convert unwritten block %d, err=%d\n",
+			logical_block, ret);
+	return ret;
+}
+
+/* maps a logical block of the inode to a physical block.
+ * as many of the following blocks as the caller asked for in bh->b_size
+ * are mapped too, as far as they are contiguous on disk, so that
+ * mpage_readpages() can read them with a single bio.
+ * a hole is left unmapped on the read path (create == 0), so reading a
+ * sparse file never allocates. on the write path, a run of contiguous
+ * blocks is allocated for as many unmapped blocks as the caller asked
+ * for. a file growing sequentially gets its new blocks right after its
+ * last one.
+ */
 static int jaguar_get_block(struct inode *i, sector_t logical_block,
 		struct buffer_head *bh, int create)
 {
-	int block, ret = 0;
+	int block, count, ret = 0;
+	unsigned int entry;
 	struct jaguar_inode *ji;
 	struct jaguar_inode_on_disk *jid;
 
@@ -1361,23 +2040,67 @@ static int jaguar_get_block(struct inode *i, sector_t logical_block,
 	ji = (struct jaguar_inode *) i->i_private;
 	jid = &ji->disk_copy;
 
-	/* convert logical block to physical block.
+	/* convert logical block to physical block. this also counts how
+	 * many of the following blocks the caller wants are mapped
+	 * contiguously, or are unmapped too for a hole.
 	 */
-	block = logical_to_phys_block(i, (int)logical_block);
+	count = lookup_blocks(i, (int)logical_block,
+			bh->b_size >> i->i_blkbits, &entry);
+	if (count < 0) {
+		ret = count;
+		goto fail;
+	}
+	block = entry & ~JAGUAR_UNWRITTEN;
 
-	if (!block) {
+	if (entry & JAGUAR_UNWRITTEN) {
+		/* an unwritten block reads as zeros. leaving the buffer
+		 * unmapped makes the read path zero it without any i/o.
+		 */
+		if (!create) {
+			DBG("logical block %d is unwritten\n", (int)logical_block);
+			bh->b_size = count << i->i_blkbits;
+			goto fail;
+		}
+
+		/* the data is written to the blocks as they are, they are
+		 * converted when the write completes.
+		 */
+		set_buffer_new(bh);
+		set_buffer_unwritten(bh);
+	} else if (block) {
+		/* already allocated, map the whole contiguous run */
+	} else if (!create) {
+		/* a hole reads as zeros, the buffer stays unmapped */
+		bh->b_size = count << i->i_blkbits;
+		goto fail;
+	} else {
 		/* no block was allocated for this offset.
-		 * allocate one now 
+		 * allocate all the unmapped blocks in one go.
 		 */
-		block = alloc_data_block(i->i_sb);
+		block = alloc_inode_data_blocks(i, find_goal(i, (int)logical_block),
+				count, &count, buffer_delay(bh) ? 1 : 0);
 		if (block < 0) {
 			ERR("could not allocate data block\n");
 			ret = -ENOMEM;
 			goto fail;
 		}
 
-		/* store the block in the inode */
-		update_inode_block_map(i, logical_block, block);
+		/* store the blocks in the inode */
+		if (update_inode_block_map(i, logical_block, block, count, 0)) {
+			ERR("could not update inode block map\n");
+			undo_alloc_run(i, (int)logical_block, block, count);
+			ret = -EIO;
+			goto fail;
+		}
+		ji->last_block = block + count - 1;
+
+		/* the caller zeroes whatever it does not overwrite */
+
+		/* a delayed buffer being placed by writepage. the block
+		 * was reserved in write_begin, so drop the reservation.
+		 */
+		if (buffer_delay(bh))
+			release_delayed_blocks(i, 1);
 
 		set_buffer_new(bh);
 	}
@@ -1385,164 +2108,1183 @@ static int jaguar_get_block(struct inode *i, sector_t logical_block,
 	set_buffer_mapped(bh);
 	bh->b_bdev = i->i_sb->s_bdev;
 	bh->b_blocknr = block;
-	bh->b_size = JAGUAR_BLOCK_SIZE;
-	DBG("mapped logical block %d to phys block %d\n", 
-			(int)logical_block, block);
+	bh->b_size = count << i->i_blkbits;
+	DBG("mapped logical block %d to phys block %d, count %d\n", 
+			(int)logical_block, block, count);
 
 fail:
 	return ret;
 }
 
+/* the page holding the inline data of a file is filled from the inode.
+ * pages past it are past the end of the file, they are just zeroed.
+ */
+static void inline_fill_page(struct inode *i, struct page *page)
+{
+	int size = 0;
+	void *kaddr;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+
+	if (page->index == 0)
+		size = min_t(loff_t, i_size_read(i), JAGUAR_INLINE_MAX);
+
+	kaddr = kmap_atomic(page);
+	memcpy(kaddr, ji->disk_copy.blocks, size);
+	memset(kaddr + size, 0, PAGE_CACHE_SIZE - size);
+	kunmap_atomic(kaddr);
+
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+}
+
 static int jaguar_readpage(struct file *filp, struct page *page)
 {
+	struct inode *i = page->mapping->host;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+
 	DBG("jaguar_readpage: entering\n");
 
+	if (ji->disk_copy.flags & INODE_FLG_INLINE) {
+		inline_fill_page(i, page);
+		unlock_page(page);
+		return 0;
+	}
+
 	return block_read_full_page(page, jaguar_get_block);
 }
 
-static int jaguar_writepage(struct page *page, struct writeback_control *wbc)
+/* readahead. jaguar_get_block() maps contiguous runs, so the pages are
+ * read with as few, large bios as the layout on disk allows.
+ */
+static int jaguar_readpages(struct file *filp, struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages)
 {
-	DBG("jaguar_writepage: entering\n");
+	struct jaguar_inode *ji = (struct jaguar_inode *) mapping->host->i_private;
 
-	return block_write_full_page(page, jaguar_get_block, wbc);
-}
+	DBG("jaguar_readpages: entering, nr_pages=%u\n", nr_pages);
 
-static int jaguar_write_begin(struct file *filp, struct address_space *mapping,
-		loff_t pos, unsigned len, unsigned flags, 
-		struct page **pagep, void **fsdata)
-{
-	DBG("jaguar_write_begin: entering, pos=%d, len=%d\n", (int)pos, len);
+	/* nothing to read ahead, jaguar_readpage() does it from the inode */
+	if (ji->disk_copy.flags & INODE_FLG_INLINE)
+		return 0;
 
-	return block_write_begin(mapping, pos, len, 
-			flags, pagep, jaguar_get_block);
+	return mpage_readpages(mapping, pages, nr_pages, jaguar_get_block);
 }
 
-static int jaguar_write_end(struct file *file, struct address_space *mapping,
-			loff_t pos, unsigned len, unsigned copied,
-			struct page *page, void *fsdata)
+/* get_block for the buffered write path (delayed allocation).
+ * blocks that are already allocated are mapped as usual. for a new
+ * block, only space is reserved and the buffer is mapped to
+ * JAGUAR_DELAYED_BLOCK. the real placement is done at writeback, in
+ * jaguar_writepages(), when the whole dirty range is known.
+ */
+static int jaguar_da_get_block(struct inode *i, sector_t logical_block,
+		struct buffer_head *bh, int create)
 {
+	int block, ret = 0;
+	unsigned int entry;
 
-	DBG("jaguar_write_end: entering, pos=%d, len=%d, copied=%d\n", (int)pos, len, copied);
+	DBG("jaguar_da_get_block: entering. inum=%d, block=%d\n",
+		(int)i->i_ino, (int)logical_block);
+
+	if ((ret = lookup_blocks(i, (int)logical_block, 1, &entry)) < 0)
+		goto out;
+	ret = 0;
+	block = entry & ~JAGUAR_UNWRITTEN;
 
-	return generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+	/* converted by the end io worker once the page is written */
+	if (entry & JAGUAR_UNWRITTEN) {
+		map_bh(bh, i->i_sb, block);
+		set_buffer_new(bh);
+		set_buffer_unwritten(bh);
+		goto out;
+	}
+
+	if (block) {
+		map_bh(bh, i->i_sb, block);
+		goto out;
+	}
+
+	if ((ret = reserve_delayed_block(i)))
+		goto out;
+
+	map_bh(bh, i->i_sb, JAGUAR_DELAYED_BLOCK);
+	set_buffer_new(bh);
+	set_buffer_delay(bh);
+
+out:
+	return ret;
 }
 
-static int jaguar_open(struct inode *i, struct file *filp)
+/* point the delayed buffers of logical blocks [start, start + count)
+ * at the physical blocks starting at 'block'.
+ */
+static void da_remap_buffers(struct inode *i, struct page **pages, int npages,
+		sector_t start, int block, int count)
 {
-	int ret = 0, logical_block;
-	struct jaguar_inode *ji;
-	struct jaguar_inode_on_disk *jid;
-	struct super_block *sb;
-	loff_t readpos;
-	mm_segment_t oldfs;
+	int n;
+	sector_t logical_block;
+	struct buffer_head *bh, *head;
+
+	for (n = 0; n < npages; n++) {
+		logical_block = (sector_t)pages[n]->index <<
+			(PAGE_CACHE_SHIFT - i->i_blkbits);
+		bh = head = page_buffers(pages[n]);
+		do {
+			if (buffer_delay(bh) && logical_block >= start &&
+			    logical_block < start + count) {
+				map_bh(bh, i->i_sb, block + (logical_block - start));
+				clear_buffer_delay(bh);
+				unmap_underlying_metadata(bh->b_bdev, bh->b_blocknr);
+			}
+			logical_block++;
+			bh = bh->b_this_page;
+		} while (bh != head);
+	}
+}
 
-	sb = i->i_sb;
-	ji = (struct jaguar_inode *) i->i_private;
-	jid = &ji->disk_copy;
+/* allocate the 'len' delayed blocks starting at logical block 'start'
+ * in as few runs as possible, right after the previous logical block.
+ */
+static int da_alloc_run(struct inode *i, struct page **pages, int npages,
+		sector_t start, int len)
+{
+	int ret = 0, block, count;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
 
-	DBG("entering jaguar_open: inum=%d\n", (int)i->i_ino);
+	DBG("da_alloc_run: entering, inum=%d, start=%d, len=%d\n",
+		(int)i->i_ino, (int)start, len);
 
-	if (jid->version_type != 0) {
-		if (ji->ver_meta_bh == NULL) {
-			/* read the version meta block into a buffer */
-			if ((ji->ver_meta_bh = __bread(sb->s_bdev, jid->ver_meta_block, JAGUAR_BLOCK_SIZE)) == NULL) {
-				ERR("could not read version meta block\n");
-				ret = -ENOMEM;
-				goto fail;
-			}
+	while (len > 0) {
+		block = alloc_inode_data_blocks(i, find_goal(i, (int)start), len,
+				&count, len);
+		if (block < 0) {
+			ERR("could not allocate data blocks\n");
+			ret = block;
+			goto fail;
 		}
 
-		if (ji->ver_data_buf == NULL) {
-			/* allocate a buffer to hold data that is to be versioned */
-			if ((ji->ver_data_buf = kmalloc(JAGUAR_BLOCK_SIZE, GFP_KERNEL)) == NULL) {
-				ERR("could not allocate version data buffer\n");
-				ret = -ENOMEM;
-				goto fail;
-			}
+		if ((ret = update_inode_block_map(i, start, block, count, 0))) {
+			ERR("could not update inode block map\n");
+			undo_alloc_run(i, (int)start, block, count);
+			goto fail;
 		}
+		ji->last_block = block + count - 1;
+
+		release_delayed_blocks(i, count);
+
+		da_remap_buffers(i, pages, npages, start, block, count);
+
+		start += count;
+		len -= count;
 	}
 
-	/* IMPORTANT: if O_TRUNC is set, then all page cache pages for this
-	 * file are freed immediately after the file is opened. the file's
-	 * data should be backed up in jaguar_open() itself.
-	 */
-	if (jid->version_type != 0 && filp && (filp->f_flags & O_TRUNC)) {
-		DBG("O_TRUNC is set, backing up all file data\n");
-		logical_block = 0;
-		readpos = 0;
-		while (1) {
-			oldfs = get_fs();
-			set_fs(KERNEL_DS);
-			ret = do_sync_read(filp, ji->ver_data_buf, JAGUAR_BLOCK_SIZE, &readpos);
-			set_fs(oldfs);
-			if (ret > 0)
-				version(filp, i, logical_block, 0);
-			if (ret < JAGUAR_BLOCK_SIZE)
-				break;
+fail:
+	return ret;
+}
+
+/* allocate blocks for all the delayed buffers in a set of locked pages
+ * with consecutive indices. each run of consecutive delayed buffers is
+ * handed to the allocator as one request.
+ */
+static int da_map_pages(struct inode *i, struct page **pages, int npages)
+{
+	int n, ret = 0, run_len = 0;
+	sector_t logical_block, run_start = 0;
+	struct buffer_head *bh, *head;
+
+	DBG("da_map_pages: entering, inum=%d, index=%d, npages=%d\n",
+		(int)i->i_ino, (int)pages[0]->index, npages);
+
+	for (n = 0; n < npages; n++) {
+		logical_block = (sector_t)pages[n]->index <<
+			(PAGE_CACHE_SHIFT - i->i_blkbits);
+		bh = head = page_buffers(pages[n]);
+		do {
+			if (buffer_delay(bh) && run_len &&
+			    logical_block == run_start + run_len) {
+				/* extends the current run */
+				run_len++;
+			} else {
+				/* the current run (if any) ended */
+				if (run_len &&
+				    (ret = da_alloc_run(i, pages, npages, run_start, run_len)))
+					goto fail;
+				run_len = 0;
+
+				if (buffer_delay(bh)) {
+					run_start = logical_block;
+					run_len = 1;
+				}
+			}
 			logical_block++;
-		}
+			bh = bh->b_this_page;
+		} while (bh != head);
 	}
 
-	return 0;
+	if (run_len)
+		ret = da_alloc_run(i, pages, npages, run_start, run_len);
 
 fail:
 	return ret;
 }
 
-static int jaguar_release(struct inode *i, struct file *f)
+static int page_has_delayed_buffers(struct page *page)
 {
-	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
-
-	DBG("entering jaguar_release: inum=%d\n", (int)i->i_ino);
+	struct buffer_head *bh, *head;
 
-	if (ji->ver_meta_bh) {
-		mark_buffer_dirty(ji->ver_meta_bh);
-		brelse(ji->ver_meta_bh);
-		ji->ver_meta_bh = NULL;
-	}
+	if (!page_has_buffers(page))
+		return 0;
 
-	if (ji->ver_data_buf) {
-		kfree(ji->ver_data_buf);
-		ji->ver_data_buf = NULL;
-	}
+	bh = head = page_buffers(page);
+	do {
+		if (buffer_delay(bh))
+			return 1;
+		bh = bh->b_this_page;
+	} while (bh != head);
 
 	return 0;
 }
 
-ssize_t jaguar_write(struct file *filp, const char __user *buf, size_t len, loff_t *pos)
+/* bio completion of a buffer written by writepage. a buffer of an
+ * unwritten block is passed to the end io worker, which converts the
+ * block before the page ends writeback, so that fsync waits for the
+ * conversion too. called in interrupt context.
+ */
+static void jaguar_end_write(struct buffer_head *bh, int uptodate)
 {
-	int logical_block, remaining = len;
-	struct inode *i;
-	struct jaguar_inode *ji;
-	struct jaguar_inode_on_disk *jid;
+	unsigned long flags;
+	struct jaguar_super_block *jsb;
 
-	DBG("jaguar_write: entering pos=%d, len=%d\n", (int)*pos, len);
+	if (!uptodate || !buffer_unwritten(bh)) {
+		end_buffer_async_write(bh, uptodate);
+		return;
+	}
 
-	i = filp->f_dentry->d_inode;
-	ji = (struct jaguar_inode *) i->i_private;
-	jid = &ji->disk_copy;
+	jsb = bh->b_page->mapping->host->i_sb->s_fs_info;
+	spin_lock_irqsave(&jsb->end_io_lock, flags);
+	bh->b_private = jsb->end_io_list;
+	jsb->end_io_list = bh;
+	spin_unlock_irqrestore(&jsb->end_io_lock, flags);
 
-	/* IMPORTANT: if O_TRUNC is set, then all page cache pages for this
-	 * file are freed immediately after the file is opened. the file's
-	 * data would have been backed up in jaguar_open() itself.
-	 * also, after freeing the pages, VFS resets the O_TRUNC flag.
-	 * so when it comes here, only O_WRONLY flag is set.
-	 * the only way to handle this case is to check the return value
-	 * of do_sync_read(). if it is 0, then file was truncated.
-	 */
-	if (jid->version_type != 0) {
-		logical_block = *pos / JAGUAR_BLOCK_SIZE;
-		while (remaining > 0) {
-			version(filp, i, logical_block, 0);
-			remaining -= JAGUAR_BLOCK_SIZE;
-			logical_block++;
-		}
-	}
+	queue_work(jsb->end_io_wq, &jsb->end_io_work);
+}
 
-	return do_sync_write(filp, buf, len, pos);
+static sector_t bh_logical_block(struct inode *i, struct buffer_head *bh)
+{
+	return ((sector_t)bh->b_page->index << (PAGE_CACHE_SHIFT - i->i_blkbits)) +
+		(bh_offset(bh) >> i->i_blkbits);
 }
 
-static const struct inode_operations jaguar_inode_ops = {
+/* convert the unwritten blocks whose writes completed. consecutive
+ * blocks of an inode are converted with one map update.
+ */
+static void end_io_work_fn(struct work_struct *work)
+{
+	int err;
+	sector_t start, len;
+	struct jaguar_super_block *jsb =
+		container_of(work, struct jaguar_super_block, end_io_work);
+	struct buffer_head *bh, *next, *list = NULL, *run;
+	struct inode *i;
+
+	spin_lock_irq(&jsb->end_io_lock);
+	bh = jsb->end_io_list;
+	jsb->end_io_list = NULL;
+	spin_unlock_irq(&jsb->end_io_lock);
+
+	/* the buffers were pushed in completion order, restore it */
+	for (; bh; bh = next) {
+		next = bh->b_private;
+		bh->b_private = list;
+		list = bh;
+	}
+
+	while (list) {
+		run = list;
+		i = run->b_page->mapping->host;
+		start = bh_logical_block(i, run);
+		len = 1;
+		for (bh = run; bh->b_private; bh = bh->b_private, len++) {
+			next = bh->b_private;
+			if (next->b_page->mapping->host != i ||
+			    bh_logical_block(i, next) != start + len)
+				break;
+		}
+		list = bh->b_private;
+		bh->b_private = NULL;
+
+		err = convert_unwritten(i, (int)start, (int)len);
+
+		for (bh = run; bh; bh = next) {
+			next = bh->b_private;
+			bh->b_private = NULL;
+			if (!err)
+				clear_buffer_unwritten(bh);
+			end_buffer_async_write(bh, !err);
+		}
+	}
+}
+
+int jaguar_end_io_init(struct super_block *sb)
+{
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+
+	spin_lock_init(&jsb->end_io_lock);
+	jsb->end_io_list = NULL;
+	INIT_WORK(&jsb->end_io_work, end_io_work_fn);
+
+	if ((jsb->end_io_wq = alloc_workqueue("jaguarfs-endio",
+			WQ_MEM_RECLAIM, 1)) == NULL) {
+		ERR("could not create workqueue\n");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* wait for the conversions queued so far, and stop the worker */
+void jaguar_end_io_exit(struct super_block *sb)
+{
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+
+	if (!jsb->end_io_wq)
+		return;
+
+	flush_workqueue(jsb->end_io_wq);
+	destroy_workqueue(jsb->end_io_wq);
+	jsb->end_io_wq = NULL;
+}
+
+/* unlock and release the pages collected by jaguar_writepages() */
+static void da_release_pages(struct page **pages, int npages)
+{
+	int n;
+
+	for (n = 0; n < npages; n++) {
+		unlock_page(pages[n]);
+		page_cache_release(pages[n]);
+	}
+}
+
+static int jaguar_writepage(struct page *page, struct writeback_control *wbc)
+{
+	void *kaddr;
+	struct inode *i = page->mapping->host;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+
+	DBG("jaguar_writepage: entering\n");
+
+	/* a page of an inline file dirtied through mmap. the data goes
+	 * back into the inode.
+	 */
+	if (ji->disk_copy.flags & INODE_FLG_INLINE) {
+		if (page->index == 0) {
+			kaddr = kmap_atomic(page);
+			memcpy(ji->disk_copy.blocks, kaddr,
+				min_t(loff_t, i_size_read(i), JAGUAR_INLINE_MAX));
+			kunmap_atomic(kaddr);
+			mark_inode_dirty(i);
+		}
+		unlock_page(page);
+		return 0;
+	}
+
+	return block_write_full_page_endio(page, jaguar_get_block, wbc,
+			jaguar_end_write);
+}
+
+/* the bio being built by da_writepage() across the pages of one
+ * writepages call
+ */
+struct da_write_ctx
+{
+	struct address_space *mapping;
+	struct bio *bio;
+	sector_t next_block;	/* the block that continues the bio */
+};
+
+/* all the pages of the bio were written, or failed */
+static void da_end_bio(struct bio *bio, int err)
+{
+	int n, uptodate = test_bit(BIO_UPTODATE, &bio->bi_flags);
+	struct page *page;
+
+	for (n = 0; n < bio->bi_vcnt; n++) {
+		page = bio->bi_io_vec[n].bv_page;
+		if (!uptodate) {
+			SetPageError(page);
+			if (page->mapping)
+				set_bit(AS_EIO, &page->mapping->flags);
+		}
+		end_page_writeback(page);
+	}
+
+	bio_put(bio);
+}
+
+static void da_submit_bio(struct da_write_ctx *ctx)
+{
+	if (ctx->bio) {
+		submit_bio(WRITE, ctx->bio);
+		ctx->bio = NULL;
+	}
+}
+
+/* the single buffer of the page, if the page can be written as it is:
+ * mapped to a placed, written block, and dirty. otherwise NULL.
+ */
+static struct buffer_head *da_simple_buffer(struct page *page)
+{
+	struct buffer_head *bh;
+
+	if (!page_has_buffers(page))
+		return NULL;
+
+	bh = page_buffers(page);
+	if (bh->b_this_page != bh || !buffer_mapped(bh) || buffer_delay(bh) ||
+	    buffer_unwritten(bh) || buffer_new(bh) || !buffer_uptodate(bh) ||
+	    !buffer_dirty(bh))
+		return NULL;
+
+	return bh;
+}
+
+/* write out one page for jaguar_writepages(), with the page locked.
+ * a block is a page, so a page whose block is placed is added to the
+ * bio being built, as long as its block follows the last one. the bio
+ * is submitted when the run on disk breaks or the bio is full.
+ * a page can get new delayed buffers after they were all placed, if it
+ * is written to again before it is written out. such a page, a page
+ * with an unwritten block, and a page past the end of the file go
+ * through block_write_full_page_endio(), which has jaguar_get_block()
+ * place them, and completes the unwritten ones with jaguar_end_write().
+ */
+static int da_writepage(struct page *page, struct writeback_control *wbc,
+		void *data)
+{
+	int ret = 0;
+	unsigned offset;
+	pgoff_t end_index;
+	struct da_write_ctx *ctx = data;
+	struct inode *i = page->mapping->host;
+	struct buffer_head *bh;
+
+	end_index = i_size_read(i) >> PAGE_CACHE_SHIFT;
+	offset = i_size_read(i) & (PAGE_CACHE_SIZE - 1);
+
+	if ((bh = da_simple_buffer(page)) == NULL || page->index > end_index ||
+	    (page->index == end_index && offset == 0)) {
+		da_submit_bio(ctx);
+		ret = block_write_full_page_endio(page, jaguar_get_block, wbc,
+				jaguar_end_write);
+		goto out;
+	}
+
+	/* the part of the last page past the end of the file */
+	if (page->index == end_index)
+		zero_user_segment(page, offset, PAGE_CACHE_SIZE);
+
+	if (ctx->bio && (bh->b_blocknr != ctx->next_block ||
+	    bio_add_page(ctx->bio, page, PAGE_CACHE_SIZE, 0) < PAGE_CACHE_SIZE))
+		da_submit_bio(ctx);
+
+	if (!ctx->bio) {
+		ctx->bio = bio_alloc(GFP_NOFS, BIO_MAX_PAGES);
+		ctx->bio->bi_bdev = bh->b_bdev;
+		ctx->bio->bi_sector = bh->b_blocknr << (i->i_blkbits - 9);
+		ctx->bio->bi_end_io = da_end_bio;
+		bio_add_page(ctx->bio, page, PAGE_CACHE_SIZE, 0);
+	}
+	ctx->next_block = bh->b_blocknr + 1;
+
+	clear_buffer_dirty(bh);
+	set_page_writeback(page);
+	unlock_page(page);
+
+out:
+	mapping_set_error(ctx->mapping, ret);
+	return ret;
+}
+
+/* writeback of a range of dirty pages.
+ * first, the delayed buffers of consecutive dirty pages are collected
+ * (pages stay locked) and placed with one allocation per run. then the
+ * pages are written out with da_writepage(), in bios that span the
+ * pages contiguous on disk.
+ * background writeback does not wait for a locked page, and collects
+ * no more pages than it is to write.
+ */
+static int jaguar_writepages(struct address_space *mapping,
+		struct writeback_control *wbc)
+{
+	int n, nr, ret = 0, npages = 0;
+	long budget = LONG_MAX;
+	pgoff_t index, end;
+	struct inode *i = mapping->host;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+	struct pagevec pvec;
+	struct page *page, **pages;
+	struct blk_plug plug;
+	struct da_write_ctx ctx;
+
+	DBG("jaguar_writepages: entering, inum=%d\n", (int)i->i_ino);
+
+	/* no blocks to place, jaguar_writepage() copies to the inode */
+	if (ji->disk_copy.flags & INODE_FLG_INLINE)
+		return generic_writepages(mapping, wbc);
+
+	if ((pages = kmalloc(JAGUAR_DA_MAX_PAGES * sizeof(*pages), GFP_NOFS)) == NULL) {
+		ERR("no memory\n");
+		return -ENOMEM;
+	}
+
+	/* start where write_cache_pages() will */
+	index = mapping->writeback_index;
+	end = ~(pgoff_t)0;
+	if (!wbc->range_cyclic) {
+		index = wbc->range_start >> PAGE_CACHE_SHIFT;
+		end = wbc->range_end >> PAGE_CACHE_SHIFT;
+	}
+	if (wbc->sync_mode == WB_SYNC_NONE)
+		budget = wbc->nr_to_write;
+
+	blk_start_plug(&plug);
+
+	pagevec_init(&pvec, 0);
+	while (budget > 0 && index <= end && (nr = pagevec_lookup_tag(&pvec,
+			mapping, &index, PAGECACHE_TAG_DIRTY, PAGEVEC_SIZE))) {
+
+		for (n = 0; n < nr && budget > 0; n++) {
+			page = pvec.pages[n];
+			if (page->index > end)
+				break;
+
+			if (wbc->sync_mode == WB_SYNC_NONE) {
+				if (!trylock_page(page))
+					continue;
+			} else
+				lock_page(page);
+
+			if (page->mapping != mapping ||
+			    !page_has_delayed_buffers(page)) {
+				unlock_page(page);
+				continue;
+			}
+
+			/* the run of pages ends here, place it */
+			if (npages == JAGUAR_DA_MAX_PAGES || (npages &&
+			    page->index != pages[npages - 1]->index + 1)) {
+				ret = da_map_pages(i, pages, npages);
+				da_release_pages(pages, npages);
+				npages = 0;
+				if (ret) {
+					unlock_page(page);
+					pagevec_release(&pvec);
+					goto fail;
+				}
+			}
+
+			page_cache_get(page);
+			pages[npages++] = page;
+			budget--;
+		}
+
+		pagevec_release(&pvec);
+		cond_resched();
+	}
+
+	if (npages) {
+		ret = da_map_pages(i, pages, npages);
+		da_release_pages(pages, npages);
+		if (ret)
+			goto fail;
+	}
+
+	ctx.mapping = mapping;
+	ctx.bio = NULL;
+	ctx.next_block = 0;
+	ret = write_cache_pages(mapping, wbc, da_writepage, &ctx);
+	da_submit_bio(&ctx);
+
+fail:
+	blk_finish_plug(&plug);
+	kfree(pages);
+	return ret;
+}
+
+/* a page is being dropped from the page cache (truncate, or eviction of
+ * a deleted inode). the space reserved for its delayed buffers is given
+ * back, so short lived files never allocate any block.
+ */
+static void jaguar_invalidatepage(struct page *page, unsigned long offset)
+{
+	unsigned long block_start = 0;
+	struct inode *i = page->mapping->host;
+	struct buffer_head *bh, *head;
+
+	DBG("jaguar_invalidatepage: entering, index=%d, offset=%d\n",
+		(int)page->index, (int)offset);
+
+	if (page_has_buffers(page)) {
+		bh = head = page_buffers(page);
+		do {
+			if (block_start >= offset && buffer_delay(bh)) {
+				clear_buffer_delay(bh);
+				release_delayed_blocks(i, 1);
+			}
+			block_start += bh->b_size;
+			bh = bh->b_this_page;
+		} while (bh != head);
+	}
+
+	block_invalidatepage(page, offset);
+}
+
+/* move the inline data of a file to a block of its own. the data is
+ * put in page 0, with a delayed buffer, and reaches the disk at the
+ * next writeback like any other write. called with i_mutex held.
+ */
+static int inline_to_block(struct inode *i)
+{
+	int ret = 0;
+	unsigned int save[JAGUAR_INODE_NUM_BLOCK_ENTRIES];
+	struct jaguar_super_block *jsb = i->i_sb->s_fs_info;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+	struct jaguar_inode_on_disk *jid = &ji->disk_copy;
+	struct page *page;
+
+	DBG("inline_to_block: entering, inum=%d, size=%d\n",
+		(int)i->i_ino, (int)i->i_size);
+
+	if ((page = grab_cache_page_write_begin(i->i_mapping, 0, 0)) == NULL) {
+		ERR("could not get page\n");
+		return -ENOMEM;
+	}
+
+	if (!PageUptodate(page))
+		inline_fill_page(i, page);
+
+	/* the inode no longer has the data, the page has it */
+	memcpy(save, jid->blocks, sizeof(save));
+	memset(jid->blocks, 0, sizeof(jid->blocks));
+	jid->flags &= ~INODE_FLG_INLINE;
+	if (jsb->disk_copy->features & JAGUAR_FEATURE_EXTENTS)
+		jaguar_ext_init(jid);
+
+	/* the page is uptodate, so its new buffers are marked dirty */
+	if (i->i_size &&
+	    (ret = __block_write_begin(page, 0, i->i_size, jaguar_da_get_block))) {
+		ERR("could not map inline data, err=%d\n", ret);
+		memcpy(jid->blocks, save, sizeof(save));
+		jid->flags &= ~INODE_FLG_EXTENTS;
+		jid->flags |= INODE_FLG_INLINE;
+		goto out;
+	}
+
+	mark_inode_dirty(i);
+
+out:
+	unlock_page(page);
+	page_cache_release(page);
+	return ret;
+}
+
+static int jaguar_write_begin(struct file *filp, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned flags, 
+		struct page **pagep, void **fsdata)
+{
+	int ret;
+	struct inode *i = mapping->host;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+	struct page *page;
+
+	DBG("jaguar_write_begin: entering, pos=%d, len=%d\n", (int)pos, len);
+
+	if (ji->disk_copy.flags & INODE_FLG_INLINE) {
+		/* the write still fits in the inode */
+		if (pos + len <= JAGUAR_INLINE_MAX) {
+			page = grab_cache_page_write_begin(mapping, 0, flags);
+			if (page == NULL)
+				return -ENOMEM;
+			if (!PageUptodate(page))
+				inline_fill_page(i, page);
+			*pagep = page;
+			return 0;
+		}
+
+		if ((ret = inline_to_block(i)))
+			return ret;
+	}
+
+	return block_write_begin(mapping, pos, len, 
+			flags, pagep, jaguar_da_get_block);
+}
+
+static int jaguar_write_end(struct file *file, struct address_space *mapping,
+			loff_t pos, unsigned len, unsigned copied,
+			struct page *page, void *fsdata)
+{
+	void *kaddr;
+	struct inode *i = mapping->host;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+
+	DBG("jaguar_write_end: entering, pos=%d, len=%d, copied=%d\n", (int)pos, len, copied);
+
+	if (!(ji->disk_copy.flags & INODE_FLG_INLINE))
+		return generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+
+	/* inline write. the page stays clean, the inode carries the data */
+	kaddr = kmap_atomic(page);
+	memcpy((char *)ji->disk_copy.blocks + pos, kaddr + pos, copied);
+	kunmap_atomic(kaddr);
+
+	if (pos + copied > i->i_size)
+		i_size_write(i, pos + copied);
+	mark_inode_dirty(i);
+
+	unlock_page(page);
+	page_cache_release(page);
+
+	return copied;
+}
+
+/* an async O_DIRECT write, completed by the end io worker */
+struct jaguar_dio_end
+{
+	struct work_struct work;
+	struct kiocb *iocb;
+	loff_t offset;
+	ssize_t size;
+	int ret;
+};
+
+/* convert the unwritten blocks of [offset, offset + size). partial
+ * blocks were zeroed around the data by the direct io code.
+ */
+static int dio_convert(struct inode *i, loff_t offset, ssize_t size)
+{
+	int start, end;
+
+	if (size <= 0)
+		return 0;
+
+	start = offset >> i->i_blkbits;
+	end = (offset + size - 1) >> i->i_blkbits;
+	return convert_unwritten(i, start, end - start + 1);
+}
+
+static void dio_end_work_fn(struct work_struct *work)
+{
+	struct jaguar_dio_end *de = container_of(work, struct jaguar_dio_end, work);
+	struct inode *i = de->iocb->ki_filp->f_mapping->host;
+
+	if (dio_convert(i, de->offset, de->size) && de->ret >= 0)
+		de->ret = -EIO;
+
+	inode_dio_done(i);
+	aio_complete(de->iocb, de->ret, 0);
+	kfree(de);
+}
+
+/* end_io of O_DIRECT writes. the unwritten blocks written to are
+ * converted only now, when the data is on disk. an async write
+ * completes in interrupt context, so its conversion goes to the worker.
+ */
+static void jaguar_dio_end_io(struct kiocb *iocb, loff_t offset, ssize_t size,
+		void *private, int ret, bool is_async)
+{
+	struct inode *i = iocb->ki_filp->f_mapping->host;
+	struct jaguar_super_block *jsb = i->i_sb->s_fs_info;
+	struct jaguar_dio_end *de = iocb->private;
+
+	if (!is_async) {
+		dio_convert(i, offset, size);
+		inode_dio_done(i);
+		return;
+	}
+
+	iocb->private = NULL;
+	de->iocb = iocb;
+	de->offset = offset;
+	de->size = size;
+	de->ret = ret;
+	queue_work(jsb->end_io_wq, &de->work);
+}
+
+/* O_DIRECT. the blocks are mapped by jaguar_get_block(), which places
+ * the holes a write covers right away, so the data goes between the
+ * user buffer and the disk without the page cache. a versioned file
+ * keeps its old data, as jaguar_write() versions the blocks before
+ * they get here.
+ */
+static ssize_t jaguar_direct_IO(int rw, struct kiocb *iocb,
+		const struct iovec *iov, loff_t offset, unsigned long nr_segs)
+{
+	ssize_t ret;
+	struct inode *i = iocb->ki_filp->f_mapping->host;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+	struct jaguar_dio_end *de = NULL;
+
+	DBG("jaguar_direct_IO: entering, inum=%d, rw=%d, offset=%lld\n",
+		(int)i->i_ino, rw, offset);
+
+	/* an inline file has no blocks. returning 0 makes the caller
+	 * fall back to buffered i/o, which handles it.
+	 */
+	if (ji->disk_copy.flags & INODE_FLG_INLINE)
+		return 0;
+
+	if (!(rw & WRITE))
+		return blockdev_direct_IO(rw, iocb, i, iov, offset, nr_segs,
+				jaguar_get_block);
+
+	/* the work item is set up now, end_io cannot allocate it */
+	if (!is_sync_kiocb(iocb)) {
+		if ((de = kmalloc(sizeof(*de), GFP_NOFS)) == NULL) {
+			ERR("no memory\n");
+			return -ENOMEM;
+		}
+		INIT_WORK(&de->work, dio_end_work_fn);
+		iocb->private = de;
+	}
+
+	ret = __blockdev_direct_IO(rw, iocb, i, i->i_sb->s_bdev, iov, offset,
+			nr_segs, jaguar_get_block, jaguar_dio_end_io, NULL,
+			DIO_LOCKING | DIO_SKIP_HOLES);
+
+	/* not queued, end_io did not take the work item */
+	if (de && ret != -EIOCBQUEUED) {
+		iocb->private = NULL;
+		kfree(de);
+	}
+
+	return ret;
+}
+
+/* read the version meta block of a versioned inode, and allocate the
+ * buffer its old data is copied to. called with ver_mutex held.
+ */
+static int ver_get_buffers(struct inode *i)
+{
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+	struct jaguar_inode_on_disk *jid = &ji->disk_copy;
+
+	if (ji->ver_meta_bh == NULL) {
+		/* read the version meta block into a buffer */
+		if ((ji->ver_meta_bh = __bread(i->i_sb->s_bdev, jid->ver_meta_block, JAGUAR_BLOCK_SIZE)) == NULL) {
+			ERR("could not read version meta block\n");
+			return -ENOMEM;
+		}
+	}
+
+	if (ji->ver_data_buf == NULL) {
+		/* allocate a buffer to hold data that is to be versioned */
+		if ((ji->ver_data_buf = kmalloc(JAGUAR_BLOCK_SIZE, GFP_KERNEL)) == NULL) {
+			ERR("could not allocate version data buffer\n");
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/* called with ver_mutex held */
+static void ver_put_buffers(struct jaguar_inode *ji)
+{
+	if (ji->ver_meta_bh) {
+		mark_buffer_dirty(ji->ver_meta_bh);
+		brelse(ji->ver_meta_bh);
+		ji->ver_meta_bh = NULL;
+	}
+
+	if (ji->ver_data_buf) {
+		kfree(ji->ver_data_buf);
+		ji->ver_data_buf = NULL;
+	}
+}
+
+/* the version buffers are kept while the inode has any opener. a shared
+ * mapping holds its file open, so page_mkwrite always finds them.
+ */
+static int jaguar_open(struct inode *i, struct file *filp)
+{
+	int ret = 0, logical_block;
+	struct jaguar_inode *ji;
+	struct jaguar_inode_on_disk *jid;
+
+	ji = (struct jaguar_inode *) i->i_private;
+	jid = &ji->disk_copy;
+
+	DBG("entering jaguar_open: inum=%d\n", (int)i->i_ino);
+
+	mutex_lock(&ji->ver_mutex);
+	if (jid->version_type != 0 && (ret = ver_get_buffers(i))) {
+		if (ji->ver_users == 0)
+			ver_put_buffers(ji);
+		mutex_unlock(&ji->ver_mutex);
+		goto fail;
+	}
+	ji->ver_users++;
+	mutex_unlock(&ji->ver_mutex);
+
+	/* IMPORTANT: if O_TRUNC is set, then all page cache pages for this
+	 * file are freed immediately after the file is opened. the file's
+	 * data should be backed up in jaguar_open() itself.
+	 */
+	if (jid->version_type != 0 && filp && (filp->f_flags & O_TRUNC)) {
+		DBG("O_TRUNC is set, backing up all file data\n");
+		logical_block = 0;
+		mutex_lock(&ji->ver_mutex);
+		while (1) {
+			ret = read_file_block(filp, i, logical_block, ji->ver_data_buf);
+			if (ret > 0)
+				__version(filp, i, logical_block, 0);
+			if (ret < JAGUAR_BLOCK_SIZE)
+				break;
+			logical_block++;
+		}
+		mutex_unlock(&ji->ver_mutex);
+	}
+
+	return 0;
+
+fail:
+	return ret;
+}
+
+static int jaguar_release(struct inode *i, struct file *f)
+{
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+
+	DBG("entering jaguar_release: inum=%d\n", (int)i->i_ino);
+
+	/* the last writer is gone, give back the unused window */
+	if (f && (f->f_mode & FMODE_WRITE) &&
+	    atomic_read(&i->i_writecount) == 1)
+		discard_prealloc(i);
+
+	mutex_lock(&ji->ver_mutex);
+	if (--ji->ver_users == 0)
+		ver_put_buffers(ji);
+	mutex_unlock(&ji->ver_mutex);
+
+	return 0;
+}
+
+ssize_t jaguar_write(struct file *filp, const char __user *buf, size_t len, loff_t *pos)
+{
+	int logical_block, remaining = len;
+	struct inode *i;
+	struct jaguar_inode *ji;
+	struct jaguar_inode_on_disk *jid;
+
+	DBG("jaguar_write: entering pos=%d, len=%d\n", (int)*pos, len);
+
+	i = filp->f_dentry->d_inode;
+	ji = (struct jaguar_inode *) i->i_private;
+	jid = &ji->disk_copy;
+
+	/* IMPORTANT: if O_TRUNC is set, then all page cache pages for this
+	 * file are freed immediately after the file is opened. the file's
+	 * data would have been backed up in jaguar_open() itself.
+	 * also, after freeing the pages, VFS resets the O_TRUNC flag.
+	 * so when it comes here, only O_WRONLY flag is set.
+	 * the only way to handle this case is to check the return value
+	 * of do_sync_read(). if it is 0, then file was truncated.
+	 */
+	if (jid->version_type != 0) {
+		logical_block = *pos / JAGUAR_BLOCK_SIZE;
+		while (remaining > 0) {
+			version(filp, i, logical_block, 0);
+			remaining -= JAGUAR_BLOCK_SIZE;
+			logical_block++;
+		}
+	}
+
+	return do_sync_write(filp, buf, len, pos);
+}
+
+/* find the next data (or hole) at or after 'offset', from the block
+ * map. unwritten blocks read as zeros, so they count as holes. there
+ * is always a hole at the end of the file.
+ */
+static loff_t seek_data_hole(struct inode *i, loff_t offset, int whence)
+{
+	int logical_block, n, data;
+	unsigned int entry;
+	loff_t size = i_size_read(i), pos;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+
+	if (offset < 0 || offset >= size)
+		return -ENXIO;
+
+	/* an inline file is all data */
+	if (ji->disk_copy.flags & INODE_FLG_INLINE)
+		return whence == SEEK_DATA ? offset : size;
+
+	logical_block = offset >> i->i_blkbits;
+	while ((pos = (loff_t)logical_block << i->i_blkbits) < size) {
+		n = lookup_blocks(i, logical_block, JAGUAR_MCACHE_RUN, &entry);
+		if (n < 0)
+			return n;
+
+		data = entry != 0 && !(entry & JAGUAR_UNWRITTEN);
+		if (data == (whence == SEEK_DATA))
+			return pos > offset ? pos : offset;
+
+		logical_block += n;
+	}
+
+	return whence == SEEK_DATA ? -ENXIO : size;
+}
+
+/* SEEK_DATA and SEEK_HOLE walk the block map. dirty pages are written
+ * back first, so that blocks still waiting for delayed allocation are
+ * in the map.
+ */
+static loff_t jaguar_llseek(struct file *filp, loff_t offset, int whence)
+{
+	loff_t ret;
+	struct inode *i = filp->f_mapping->host;
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+		return generic_file_llseek(filp, offset, whence);
+
+	DBG("jaguar_llseek: entering, inum=%d, offset=%lld, whence=%d\n",
+		(int)i->i_ino, offset, whence);
+
+	mutex_lock(&i->i_mutex);
+
+	if ((ret = filemap_write_and_wait(i->i_mapping)))
+		goto out;
+
+	if ((ret = seek_data_hole(i, offset, whence)) < 0)
+		goto out;
+
+	if (ret > i->i_sb->s_maxbytes) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (ret != filp->f_pos) {
+		filp->f_pos = ret;
+		filp->f_version = 0;
+	}
+
+out:
+	mutex_unlock(&i->i_mutex);
+	return ret;
+}
+
+/* map 'count' blocks from 'logical_block' on, which are all holes, to
+ * newly allocated blocks marked unwritten.
+ */
+static int fallocate_run(struct inode *i, int logical_block, int count)
+{
+	int block, n;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+
+	while (count > 0) {
+		block = alloc_inode_data_blocks(i, find_goal(i, logical_block),
+				count, &n, count);
+		if (block < 0) {
+			ERR("could not allocate data blocks\n");
+			return -ENOSPC;
+		}
+
+		if (update_inode_block_map(i, logical_block, block, n,
+				JAGUAR_UNWRITTEN)) {
+			ERR("could not update inode block map\n");
+			return -EIO;
+		}
+		ji->last_block = block + n - 1;
+
+		logical_block += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+/* preallocate blocks for [offset, offset + len).
+ * the holes in the range get blocks marked unwritten, so nothing is
+ * written to disk but the block map. blocks that are already mapped
+ * are left alone.
+ */
+static long jaguar_fallocate(struct file *filp, int mode, loff_t offset, loff_t len)
+{
+	int logical_block, end, n;
+	long ret = 0;
+	unsigned int entry;
+	struct inode *i = filp->f_dentry->d_inode;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+	struct super_block *sb = i->i_sb;
+
+	DBG("jaguar_fallocate: entering inum=%d, mode=%d, offset=%lld, len=%lld\n",
+		(int)i->i_ino, mode, offset, len);
+
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+
+	if (!S_ISREG(i->i_mode))
+		return -ENODEV;
+
+	logical_block = offset >> i->i_blkbits;
+	if (((offset + len - 1) >> i->i_blkbits) >= JAGUAR_MAX_FILE_BLOCKS)
+		return -EFBIG;
+	end = (offset + len - 1) >> i->i_blkbits;
+
+	mutex_lock(&i->i_mutex);
+
+	/* blocks are mapped below, the data cannot stay inline. its block
+	 * is placed right away, so that it is not taken for a hole.
+	 */
+	if (ji->disk_copy.flags & INODE_FLG_INLINE) {
+		if ((ret = inline_to_block(i)) ||
+		    (ret = filemap_write_and_wait_range(i->i_mapping, 0,
+				JAGUAR_BLOCK_SIZE - 1)))
+			goto out;
+	}
+
+	/* delayed buffers in the range would get blocks of their own at
+	 * writeback. place them now, so that they are not mistaken for
+	 * holes below.
+	 */
+	if ((ret = filemap_write_and_wait_range(i->i_mapping, offset,
+			offset + len - 1)))
+		goto out;
+
+	while (logical_block <= end) {
+		n = lookup_blocks(i, logical_block, end - logical_block + 1, &entry);
+		if (n < 0) {
+			ret = n;
+			goto out;
+		}
+
+		if (entry == 0) {
+			/* a hole. the reservation makes sure the blocks are
+			 * not taken from delayed allocations of other files.
+			 */
+			if ((ret = reserve_data_blocks(sb, n)))
+				goto out;
+			ret = fallocate_run(i, logical_block, n);
+			release_data_blocks(sb, n);
+			if (ret)
+				goto out;
+		}
+
+		logical_block += n;
+	}
+
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + len > i_size_read(i))
+		i_size_write(i, offset + len);
+	mark_inode_dirty(i);
+
+out:
+	mutex_unlock(&i->i_mutex);
+	return ret;
+}
+
+static const struct inode_operations jaguar_inode_ops = {
 	.lookup		= jaguar_lookup,
 	.mkdir		= jaguar_mkdir,
 	.rmdir		= jaguar_rmdir,
@@ -1550,26 +3292,126 @@ static const struct inode_operations jaguar_inode_ops = {
 	.unlink		= jaguar_unlink
 };
 
+/* a page of a shared mapping is about to be written. its old contents
+ * are versioned first, as jaguar_write() does for write(). version()
+ * reads the old block through the page cache, so it runs before the
+ * page is locked.
+ */
+static int jaguar_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	int ret;
+	struct file *filp = vma->vm_file;
+	struct inode *i = filp->f_dentry->d_inode;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+	struct page *page = vmf->page;
+
+	DBG("jaguar_page_mkwrite: entering, inum=%d, index=%d\n",
+		(int)i->i_ino, (int)page->index);
+
+	if (ji->disk_copy.version_type != 0)
+		version(filp, i, (int)page->index, 0);
+
+	/* an inline file has no blocks to map. jaguar_writepage() puts
+	 * the page back into the inode.
+	 */
+	if (ji->disk_copy.flags & INODE_FLG_INLINE) {
+		lock_page(page);
+		if (page->mapping != i->i_mapping) {
+			unlock_page(page);
+			return VM_FAULT_NOPAGE;
+		}
+		set_page_dirty(page);
+		return VM_FAULT_LOCKED;
+	}
+
+	ret = block_page_mkwrite(vma, vmf, jaguar_da_get_block);
+	return block_page_mkwrite_return(ret);
+}
+
+static const struct vm_operations_struct jaguar_file_vm_ops = {
+	.fault		= filemap_fault,
+	.page_mkwrite	= jaguar_page_mkwrite
+};
+
+static int jaguar_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	int ret;
+
+	if ((ret = generic_file_mmap(filp, vma)) == 0)
+		vma->vm_ops = &jaguar_file_vm_ops;
+
+	return ret;
+}
+
 static const struct file_operations jaguar_file_ops = {
 	.readdir	= jaguar_readdir,
 	.read		= do_sync_read,
 	.write		= jaguar_write,
 	.aio_read	= generic_file_aio_read,
 	.aio_write	= generic_file_aio_write,
-	.llseek		= generic_file_llseek,
+	.llseek		= jaguar_llseek,
+	.mmap		= jaguar_mmap,
 	.unlocked_ioctl	= jaguar_ioctl,
 	.open		= jaguar_open,
 	.release	= jaguar_release,
-	.fsync		= generic_file_fsync
+	.fsync		= generic_file_fsync,
+	.fallocate	= jaguar_fallocate
 };
 
 static const struct address_space_operations jaguar_aops = {
 	.readpage	= jaguar_readpage,
+	.readpages	= jaguar_readpages,
 	.writepage	= jaguar_writepage,
+	.writepages	= jaguar_writepages,
+	.invalidatepage	= jaguar_invalidatepage,
 	.write_begin	= jaguar_write_begin,
-	.write_end	= jaguar_write_end
+	.write_end	= jaguar_write_end,
+	.direct_IO	= jaguar_direct_IO
 };
 
+/* the inode is leaving the inode cache. if it was unlinked, this was
+ * the last reference to it, so it is queued for freeing.
+ */
+void jaguar_evict_inode(struct inode *i)
+{
+	int n_blocks;
+	struct jaguar_inode *ji = (struct jaguar_inode *) i->i_private;
+
+	DBG("jaguar_evict_inode: entering, inum=%d, nlink=%d\n",
+		(int)i->i_ino, i->i_nlink);
+
+	truncate_inode_pages(&i->i_data, 0);
+
+	/* a bad inode from a failed iget has nothing else to clean up */
+	if (!ji) {
+		clear_inode(i);
+		return;
+	}
+
+	/* a window can be opened at writeback, after the last release,
+	 * so even a linked inode may still have one.
+	 */
+	discard_prealloc(i);
+
+	if (!i->i_nlink) {
+		write_inode_to_disk(i);
+		n_blocks = (i->i_size + JAGUAR_BLOCK_SIZE - 1) / JAGUAR_BLOCK_SIZE;
+		jaguar_orphan_queue(i->i_sb, i->i_ino, n_blocks);
+	}
+
+	invalidate_inode_buffers(i);
+	clear_inode(i);
+
+	jaguar_mcache_drop(i);
+	if (ji->ver_meta_bh)
+		brelse(ji->ver_meta_bh);
+	if (ji->ver_data_buf)
+		kfree(ji->ver_data_buf);
+	kfree(ji->free_slots);
+	kfree(ji);
+	i->i_private = NULL;
+}
+
 /* Reads a disk inode with number i->i_ino, and fills 'i' with the info.
  */
 int fill_inode(struct inode *i)
@@ -1588,7 +3430,7 @@ int fill_inode(struct inode *i)
 	//DBG("inode %d: size=%d, type=%d\n", (int)i->i_ino, ji->disk_copy.size, ji->disk_copy.type);
 
 	/* setup the inode fields */
-	i->i_size = ji->disk_copy.size;
+	i->i_size = JAGUAR_I_SIZE(&ji->disk_copy);
 	set_nlink(i, ji->disk_copy.nlink);
 	if (ji->disk_copy.type == INODE_TYPE_FILE)
 		i->i_mode = S_IFREG | 0777;
@@ -1621,6 +3463,11 @@ struct inode * jaguar_iget(struct super_block *sb, int inum)
 	}
 
 	i->i_private = ji;
+	INIT_LIST_HEAD(&ji->pa_list);
+	INIT_LIST_HEAD(&ji->pa_group_list);
+	mutex_init(&ji->ver_mutex);
+	mutex_init(&ji->map_mutex);
+	jaguar_mcache_init(ji);
 
 	/* read inode info from disk */
 	if (fill_inode(i)) {
@@ -1635,6 +3482,8 @@ struct inode * jaguar_iget(struct super_block *sb, int inum)
 fail:
 	if (ji)
 		kfree(ji);
+	i->i_private = NULL;
+	iget_failed(i);
 
 	return NULL;
 }
@@ -1650,21 +3499,29 @@ int set_version(struct inode *i, struct version_info *info)
 
 	/* mark the inode as versioned */
 	ji = (struct jaguar_inode *) i->i_private;
-	ji->ver_meta_bh = NULL;
 	jid = &ji->disk_copy;
+
+	mutex_lock(&ji->ver_mutex);
 	jid->version_type = info->type;
 	jid->version_param = info->param;
 
 	if (jid->ver_meta_block == 0) {
+		/* a buffer left from an earlier versioning is stale */
+		ver_put_buffers(ji);
 		if ((ret = alloc_version_meta_block(i)) < 0) {
 			ERR("error allocating version meta block\n");
 			goto fail;
 		}
 	}
 
+	/* the inode is already open, the openers version from now on */
+	if (ji->ver_users && (ret = ver_get_buffers(i)))
+		goto fail;
+
 	mark_inode_dirty(i);
 
 fail:
+	mutex_unlock(&ji->ver_mutex);
 	return ret;
 }
 
@@ -1677,9 +3534,13 @@ int reset_version(struct inode *i)
 
 	ji = (struct jaguar_inode *) i->i_private;
 	jid = &ji->disk_copy;
+
+	mutex_lock(&ji->ver_mutex);
 	jid->version_type = 0;
 	jid->version_param = 0;
 	jid->ver_meta_block = 0;
+	ver_put_buffers(ji);
+	mutex_unlock(&ji->ver_mutex);
 	mark_inode_dirty(i);
 
 	return 0;
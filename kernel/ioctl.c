@@ -1,4 +1,5 @@
 #include <linux/fs.h>
+#include <linux/mount.h>
 #include <asm/uaccess.h>
 #include "jaguar.h"
 #include "debug.h"
@@ -48,6 +49,33 @@ static int do_rollback_dir(struct inode *i, struct version_buffer __user *ver_bu
 	return rollback_dir(i, offset, nbytes, ver_buf->data);
 }
 
+/* compaction rewrites the dir, so it needs the same rights as creating
+ * or removing an entry in it, and a writable mount.
+ */
+static int do_compact_dir(struct file *filp)
+{
+	int ret;
+	struct inode *i = filp->f_dentry->d_inode;
+
+	if (!S_ISDIR(i->i_mode))
+		return -ENOTDIR;
+
+	if ((ret = inode_permission(i, MAY_WRITE | MAY_EXEC)) &&
+	    !inode_owner_or_capable(i))
+		return ret;
+
+	if ((ret = mnt_want_write_file(filp)))
+		return ret;
+
+	mutex_lock(&i->i_mutex);
+	ret = compact_dir(i);
+	mutex_unlock(&i->i_mutex);
+
+	mnt_drop_write_file(filp);
+
+	return ret;
+}
+
 static int do_reset_stat(void)
 {
 	DBG("do_reset_stat: entering\n");
@@ -56,10 +84,13 @@ static int do_reset_stat(void)
 	return 0;
 }
 
-static int do_dump_stat(void)
+static int do_dump_stat(struct super_block *sb)
 {
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+
 	DBG("do_dump_stat: entering\n");
 	ERR("num_version_calls=%d\n", num_version_calls);
+	ERR("n_blocks_pending=%d\n", jsb->n_blocks_pending);
 
 	return 0;
 }
@@ -87,11 +118,14 @@ long jaguar_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	case JAGUAR_IOC_ROLLBACK_DIR:
 		ret = do_rollback_dir(i, (struct version_buffer *)arg);
 		break;
+	case JAGUAR_IOC_COMPACT_DIR:
+		ret = do_compact_dir(filp);
+		break;
 	case JAGUAR_IOC_RESET_STAT:
 		ret = do_reset_stat();
 		break;
 	case JAGUAR_IOC_DUMP_STAT:
-		ret = do_dump_stat();
+		ret = do_dump_stat(i->i_sb);
 		break;
 	default:
 		ret = -ENOTTY;
@@ -2,17 +2,34 @@
 #define JAGUAR_H
 
 #include <linux/ioctl.h>
+#include <linux/workqueue.h>
+#include <linux/rbtree.h>
+#include <linux/shrinker.h>
+#include "bitmap.h"
 
 #define JAGUAR_MAGIC			0x4a41 // JA
 #define JAGUAR_BLOCK_SIZE		4096
 #define JAGUAR_INODE_SIZE		128
 #define JAGUAR_INODE_NUM_BLOCK_ENTRIES	15
 #define JAGUAR_FILENAME_MAX		60
+#define JAGUAR_MAX_FILE_BLOCKS		(12 + 1024 + 1024 * 1024 + 1024 * 1024 * 1024)	/* direct to triple indirect */
+#define JAGUAR_IND_READAHEAD		8	/* indirect blocks read ahead */
 
 #define BYTES_TO_BLOCK(b)		((b)/JAGUAR_BLOCK_SIZE)
 #define JAGUAR_NUM_INODES_PER_BLOCK	(JAGUAR_BLOCK_SIZE / JAGUAR_INODE_SIZE)
 #define NUM_BITS_PER_BLOCK		(JAGUAR_BLOCK_SIZE * 8)
 
+/* allocation groups.
+ * group g owns the data blocks of data bitmap block g, and the inodes
+ * of one half of an inode bitmap block (one inode per 2 data blocks).
+ */
+#define JAGUAR_BLOCKS_PER_GROUP		NUM_BITS_PER_BLOCK
+#define JAGUAR_INODES_PER_GROUP		(NUM_BITS_PER_BLOCK / 2)
+#define JAGUAR_GROUP_DESCS_PER_BLOCK	(JAGUAR_BLOCK_SIZE / sizeof(struct jaguar_group_desc_on_disk))
+#define JAGUAR_PREALLOC_BLOCKS		64	/* per-inode window, in blocks */
+#define BLOCK_TO_GROUP(b)		((b) / JAGUAR_BLOCKS_PER_GROUP)
+#define INUM_TO_GROUP(ino)		((ino) / JAGUAR_INODES_PER_GROUP)
+
 #define INUM_TO_BLOCK(ino)		((ino) / JAGUAR_NUM_INODES_PER_BLOCK)
 #define INUM_TO_OFFSET(ino)		(((ino) % JAGUAR_NUM_INODES_PER_BLOCK) * JAGUAR_INODE_SIZE)
 
@@ -20,6 +37,35 @@
 #define INODE_TYPE_DIR			2
 
 #define INODE_FLG_VERSIONED		0x1
+#define INODE_FLG_EXTENTS		0x2	/* blocks[] holds an extent tree */
+#define INODE_FLG_INLINE		0x4	/* blocks[] holds the file data */
+
+/* super block feature flags */
+#define JAGUAR_FEATURE_EXTENTS		0x1	/* new inodes use extents */
+#define JAGUAR_FEATURE_64BIT		0x2	/* large volumes and files */
+#define JAGUAR_FEATURE_INLINE_DATA	0x4	/* new files start inline */
+#define JAGUAR_FEATURE_FILETYPE		0x8	/* dentries record the inode type */
+
+/* a file with INODE_FLG_INLINE has no blocks, its data (up to this
+ * many bytes) is kept in the blocks[] of the inode. it gets a block of
+ * its own once it grows past that.
+ */
+#define JAGUAR_INLINE_MAX		(JAGUAR_INODE_NUM_BLOCK_ENTRIES * 4)
+
+/* the layout fields (xxx_start, xxx_size) of the super block are in
+ * bytes, which limits the volume to 2 GB. a JAGUAR_FEATURE_64BIT fs
+ * has them in blocks instead.
+ */
+#define SB_LAYOUT_BLOCK(jsbd, field)	(((jsbd)->features & JAGUAR_FEATURE_64BIT) ? \
+	(jsbd)->field : BYTES_TO_BLOCK((jsbd)->field))
+
+/* 64 bit file size of an on-disk inode.
+ * size_hi is only ever non zero on a JAGUAR_FEATURE_64BIT fs.
+ */
+#define JAGUAR_I_SIZE(jid)		(((loff_t)(jid)->size_hi << 32) | \
+	(unsigned int)(jid)->size)
+#define JAGUAR_SET_I_SIZE(jid, s)	do { (jid)->size = (int)(s); \
+	(jid)->size_hi = (int)((s) >> 32); } while (0)
 
 /* 
  * ioctls
@@ -31,6 +77,7 @@
 #define JAGUAR_IOC_ROLLBACK_DIR		_IOW('f', 104, int)
 #define JAGUAR_IOC_RESET_STAT		_IO('f', 105)
 #define JAGUAR_IOC_DUMP_STAT		_IO('f', 106)
+#define JAGUAR_IOC_COMPACT_DIR		_IO('f', 107)
 
 /*
  * version flags
@@ -42,6 +89,26 @@
 #define VERSION_METADATA_MAX_ENTRIES	255
 //#define VERSION_METADATA_MAX_ENTRIES	3
 
+/*
+ * delayed allocation.
+ * a buffer that has space reserved, but no block allocated yet, is
+ * mapped to JAGUAR_DELAYED_BLOCK until writeback places it.
+ */
+#define JAGUAR_DELAYED_BLOCK		((sector_t)~0ULL)
+#define JAGUAR_DA_MAX_PAGES		1024
+
+/* map blocks that placing one delayed block may allocate, at worst: one
+ * per level of the extent tree. a block map needs three at most.
+ */
+#define JAGUAR_DA_META_BLOCKS		JAGUAR_EXT_MAX_DEPTH
+
+/*
+ * block map entry flag for blocks allocated by fallocate, that were
+ * never written. they read as zeros without going to disk. the flag is
+ * cleared when the block is first mapped for a write.
+ */
+#define JAGUAR_UNWRITTEN		0x80000000U
+
 /*
  * On-disk data structures.
  */
@@ -67,6 +134,21 @@ struct jaguar_super_block_on_disk
 	int next_free_block;
 	int next_free_inode;
 
+	int n_groups;
+	int gdt_start;
+	int gdt_size;
+
+	int orphan_head;	/* first unlinked inode waiting to be freed */
+
+	int features;		/* JAGUAR_FEATURE_xxx */
+};
+
+struct jaguar_group_desc_on_disk
+{
+	int n_blocks_free;
+	int n_inodes_free;
+	int next_free_block;	/* allocation hints within the group */
+	int next_free_inode;
 };
 
 struct jaguar_inode_on_disk
@@ -78,13 +160,108 @@ struct jaguar_inode_on_disk
 	int ver_meta_block;
 	int version_type;	/* one of JAGUAR_KEEP_xxx */
 	int version_param;	/* depends on version type */
-	char rsvd[44];
+	int next_orphan;	/* next inode on the orphan list */
+	int flags;		/* INODE_FLG_xxx */
+	int size_hi;		/* high word of the size */
+	int dir_index;		/* root block of the dir index, or 0 */
+	int prev_orphan;	/* previous inode on the orphan list, 0 at its head */
+	char rsvd[24];
+};
+
+/*
+ * extent tree.
+ * an inode with INODE_FLG_EXTENTS keeps the root of the tree in its
+ * blocks[]: a header, and up to JAGUAR_EXT_INLINE entries. the entries
+ * of a node are sorted by logical block. leaves (depth 0) hold extents,
+ * the other nodes hold index entries pointing to extent blocks one
+ * level down. an index entry's logical block is a lower bound of the
+ * blocks mapped below it.
+ */
+#define JAGUAR_EXT_MAGIC		0x4a45 // JE
+#define JAGUAR_EXT_MAX_DEPTH		4
+#define JAGUAR_EXT_MAX_LEN		0x7fffffff
+#define JAGUAR_EXT_INLINE		((JAGUAR_INODE_NUM_BLOCK_ENTRIES * 4 - \
+	sizeof(struct jaguar_extent_header)) / sizeof(struct jaguar_extent))
+#define JAGUAR_EXT_PER_BLOCK		((JAGUAR_BLOCK_SIZE - \
+	sizeof(struct jaguar_extent_header)) / sizeof(struct jaguar_extent))
+
+struct jaguar_extent_header
+{
+	unsigned short magic;
+	unsigned short entries;
+	unsigned short max;
+	unsigned short depth;		/* 0 for a leaf */
+};
+
+/* 'len' blocks from 'logical' on are at 'start' on.
+ * JAGUAR_UNWRITTEN in 'len' marks an extent allocated by fallocate.
+ */
+struct jaguar_extent
+{
+	unsigned int logical;
+	unsigned int start;
+	unsigned int len;
 };
 
+/* same layout as an extent, so both are searched alike */
+struct jaguar_extent_idx
+{
+	unsigned int logical;
+	unsigned int block;
+	unsigned int rsvd;
+};
+
+/* file_type is the INODE_TYPE_xxx of the inode, and only means something
+ * on a JAGUAR_FEATURE_FILETYPE fs. there it takes the last byte of the
+ * name, so names are one char shorter. on an older fs a name of the full
+ * length runs into file_type, which holds its terminating 0.
+ */
 struct jaguar_dentry_on_disk
 {
 	unsigned int inum;
-	char name[JAGUAR_FILENAME_MAX];
+	char name[JAGUAR_FILENAME_MAX - 1];
+	unsigned char file_type;
+};
+
+#define JAGUAR_NAME_LEN(jsbd)		(((jsbd)->features & JAGUAR_FEATURE_FILETYPE) ? \
+	JAGUAR_FILENAME_MAX - 2 : JAGUAR_FILENAME_MAX - 1)
+
+#define JAGUAR_DENTRIES_PER_BLOCK	(JAGUAR_BLOCK_SIZE / sizeof(struct jaguar_dentry_on_disk))
+
+/*
+ * directory index.
+ * a dir of JAGUAR_DX_MIN_BLOCKS blocks or more gets a hash table of its
+ * dentries, rooted at the dir_index block of its inode. the root points
+ * to the buckets, a name goes to bucket (hash & (nbuckets - 1)). a
+ * bucket is a chain of blocks of (hash, slot) pairs, slot being the
+ * dentry's position in the dir divided by the dentry size.
+ * the table doubles when it is 3/4 full.
+ */
+#define JAGUAR_DX_MAGIC			0x4a44	// JD
+#define JAGUAR_DX_MIN_BLOCKS		4
+#define JAGUAR_DX_MAX_BUCKETS		512
+#define JAGUAR_DX_PER_BUCKET		511
+
+struct jaguar_dx_root
+{
+	unsigned int magic;
+	unsigned int nbuckets;		/* a power of 2 */
+	unsigned int count;		/* num of entries in all buckets */
+	unsigned int rsvd;
+	unsigned int bucket[JAGUAR_BLOCK_SIZE / 4 - 4];	/* first block of each */
+};
+
+struct jaguar_dx_entry
+{
+	unsigned int hash;
+	unsigned int slot;
+};
+
+struct jaguar_dx_bucket
+{
+	unsigned int count;
+	unsigned int next;		/* next block of the chain, or 0 */
+	struct jaguar_dx_entry entry[JAGUAR_DX_PER_BUCKET];
 };
 
 struct jaguar_version_metadata
@@ -107,10 +284,72 @@ struct jaguar_version_metadata
 /*
  * In-memory data structures
  */
+
+/* an on-disk bitmap */
+struct jaguar_bmap
+{
+	int start;		/* first block of the bitmap on disk */
+	int size;		/* num blocks the bitmap occupies */
+	int nbits;		/* num valid bits, ie num blocks/inodes */
+};
+
+/* an allocation group. the group descriptor lives in a buffer of the
+ * group descriptor table, which is pinned until put_super.
+ * the free counts in the descriptors act as the free space summary, so
+ * allocation goes straight to a group that has free bits.
+ */
+struct jaguar_group
+{
+	struct mutex lock;	/* protects the group's bitmap bits and desc */
+	struct buffer_head *bh;
+	struct jaguar_group_desc_on_disk *desc;
+	struct list_head windows;	/* prealloc windows, under jsb->lock */
+	int n_prealloc;		/* free blocks held in them, under jsb->lock */
+};
+
+/* an unlinked inode queued for the background free worker */
+struct jaguar_orphan
+{
+	struct list_head list;
+	int inum;
+	int n_blocks;		/* estimate, for statfs */
+};
+
 struct jaguar_super_block
 {
 	struct buffer_head *bh;
 	struct jaguar_super_block_on_disk *disk_copy;
+	struct jaguar_bmap data_bmap;
+	struct jaguar_bmap inode_bmap;
+	struct jaguar_group *groups;
+	spinlock_t lock;	/* protects the counters and prealloc windows */
+	int n_blocks_reserved;	/* reserved by delayed allocation */
+	int n_blocks_prealloc;	/* held in inode prealloc windows */
+	int n_prealloc_inodes;
+	struct list_head prealloc_inodes;	/* inodes with a window */
+	struct shrinker pa_shrinker;
+
+	/* deferred freeing of unlinked inodes */
+	struct super_block *sb;
+	struct mutex orphan_lock;	/* protects the on-disk orphan list */
+	struct list_head orphan_queue;	/* under 'lock' */
+	int n_blocks_pending;		/* under 'lock' */
+	struct workqueue_struct *orphan_wq;
+	struct work_struct orphan_work;
+
+	/* writes to unwritten blocks that completed, for the worker that
+	 * clears the flag in the map before the pages end writeback
+	 */
+	spinlock_t end_io_lock;
+	struct buffer_head *end_io_list;	/* chained through b_private */
+	struct workqueue_struct *end_io_wq;
+	struct work_struct end_io_work;
+
+	/* inodes with a mapping cache, for the shrinker */
+	spinlock_t mc_lock;
+	struct list_head mc_inodes;
+	atomic_t mc_count;		/* cached runs of all inodes */
+	struct shrinker mc_shrinker;
 };
 
 struct jaguar_inode
@@ -118,6 +357,46 @@ struct jaguar_inode
 	struct jaguar_inode_on_disk disk_copy;
 	struct buffer_head *ver_meta_bh;
 	char *ver_data_buf;
+	struct mutex ver_mutex;	/* serializes version(), guards the above */
+	struct mutex map_mutex;	/* serializes reads and updates of the map */
+	int ver_users;		/* openers, the buffers above live as long */
+	int n_reserved;		/* delayed allocation blocks reserved */
+	int n_meta_reserved;	/* map blocks reserved for placing them */
+	int last_block;		/* last data block allocated, placement goal */
+	int map_next;		/* where the last block map read ended */
+
+	/* free dentry slots of a dir, a stack built on the first create */
+	int *free_slots;	/* NULL if not built */
+	int n_free_slots;
+	int max_free_slots;
+
+	/* preallocation window: free blocks kept aside in memory for this
+	 * inode, handed out to its next allocations. under jsb->lock.
+	 */
+	int pa_start;
+	int pa_len;
+	struct list_head pa_list;	/* on jsb->prealloc_inodes */
+	struct list_head pa_group_list;	/* on the windows of its group */
+
+	/* mapping cache of runs of the block map */
+	spinlock_t mc_lock;
+	struct rb_root mc_root;
+	int mc_count;
+	unsigned int mc_seq;		/* bumped on every map update */
+	struct list_head mc_list;	/* on jsb->mc_inodes */
+};
+
+/* data blocks being freed together.
+ * the blocks are collected, and freed a bitmap block at a time.
+ */
+#define JAGUAR_FREE_BATCH_MAX		(JAGUAR_BLOCK_SIZE / sizeof(int))
+
+struct jaguar_free_batch
+{
+	struct super_block *sb;
+	int *blocks;		/* NULL if it could not be allocated */
+	int n;
+	int ret;		/* first error seen while freeing */
 };
 
 struct version_buffer 
@@ -146,11 +425,34 @@ int jaguar_fill_super(struct super_block *sb, void *data, int silent);
  */
 struct inode * jaguar_iget(struct super_block *sb, int inum);
 int write_inode_to_disk(struct inode *i);
+void jaguar_evict_inode(struct inode *i);
+int free_inode_blocks(struct super_block *sb, struct jaguar_inode_on_disk *jid);
+int logical_to_phys_block(struct inode *i, int logical_block);
+int compact_dir(struct inode *i);
+int jaguar_end_io_init(struct super_block *sb);
+void jaguar_end_io_exit(struct super_block *sb);
 
 /*
  * Data block APIs
  */
-int alloc_data_block(struct super_block *sb);
+int alloc_data_blocks(struct super_block *sb, int goal, int min, int max,
+	int *count);
+int alloc_data_block(struct super_block *sb, int goal);
+int alloc_map_block(struct inode *i, int goal);
+int alloc_inode_data_blocks(struct inode *i, int goal, int max, int *count,
+	int reserved);
+void discard_prealloc(struct inode *i);
+void discard_all_prealloc(struct super_block *sb);
+void jaguar_prealloc_register(struct super_block *sb);
+void jaguar_prealloc_unregister(struct super_block *sb);
+void free_batch_init(struct jaguar_free_batch *fb, struct super_block *sb);
+int free_batch_add(struct jaguar_free_batch *fb, int block);
+int free_batch_finish(struct jaguar_free_batch *fb);
+int zero_data_blocks(struct super_block *sb, int block, int count);
+int reserve_data_blocks(struct super_block *sb, int count);
+void release_data_blocks(struct super_block *sb, int count);
+int reserve_delayed_block(struct inode *i);
+void release_delayed_blocks(struct inode *i, int count);
 int free_data_block(struct super_block *sb, int block);
 
 /*
@@ -161,12 +463,86 @@ int alloc_version_meta_block(struct inode *i);
 /*
  * Utility APIs
  */
-int jaguar_find_first_zero_bit(void *bmap, int size);
-void jaguar_set_bit(void *bmap, int pos);
-void jaguar_clear_bit(void *bmap, int pos);
-int jaguar_bmap_alloc_bit(struct block_device *bdev,
-	int bmap_start, int bmap_size, int start);
-int jaguar_bmap_free_bit(struct block_device *bdev, int bmap_start, int bit);
+int jaguar_bmap_count_free(struct super_block *sb, struct jaguar_bmap *bmap,
+	int lo, int hi);
+int jaguar_bmap_find_run(struct super_block *sb, struct jaguar_bmap *bmap,
+	int lo, int hi, int goal, int min, int max, int *count,
+	struct list_head *windows);
+int jaguar_bmap_set_run(struct super_block *sb, struct jaguar_bmap *bmap,
+	int start, int count);
+int jaguar_bmap_alloc_run(struct super_block *sb, struct jaguar_bmap *bmap,
+	int lo, int hi, int goal, int min, int max, int *count);
+int jaguar_bmap_free_bit(struct super_block *sb, struct jaguar_bmap *bmap,
+	int bit);
+int jaguar_bmap_free_bits(struct super_block *sb, struct jaguar_bmap *bmap,
+	int *bits, int n);
+
+/*
+ * Allocation group APIs
+ */
+int jaguar_load_groups(struct super_block *sb);
+void jaguar_put_groups(struct super_block *sb);
+int jaguar_preferred_group(struct super_block *sb);
+int jaguar_group_for_dir(struct super_block *sb);
+int jaguar_group_goal(struct super_block *sb, int group);
+int jaguar_group_alloc_blocks(struct super_block *sb, int goal,
+	int min, int max, int *count, struct jaguar_inode *ji, int pa_max);
+int jaguar_group_take_window(struct super_block *sb, struct jaguar_inode *ji,
+	int goal, int max, int *count);
+int jaguar_group_free_block(struct super_block *sb, int block);
+int jaguar_group_free_blocks(struct super_block *sb, int *blocks, int n);
+int jaguar_group_alloc_inode(struct super_block *sb, int group);
+int jaguar_group_free_inode(struct super_block *sb, int inum);
+
+/*
+ * Orphan list APIs
+ */
+int jaguar_orphan_init(struct super_block *sb);
+void jaguar_orphan_exit(struct super_block *sb);
+int jaguar_orphan_add(struct inode *i);
+void jaguar_orphan_queue(struct super_block *sb, int inum, int n_blocks);
+int jaguar_orphan_next(struct super_block *sb, int inum);
+
+/*
+ * Extent tree APIs
+ */
+void jaguar_ext_init(struct jaguar_inode_on_disk *jid);
+int jaguar_ext_lookup(struct inode *i, int logical_block, int max,
+	unsigned int *entry);
+int jaguar_ext_map(struct inode *i, int logical_block, int phys_block,
+	int count, unsigned int flags);
+int jaguar_ext_truncate(struct inode *i, int logical_block,
+	struct jaguar_free_batch *fb);
+int jaguar_ext_free(struct super_block *sb, struct jaguar_inode_on_disk *jid,
+	struct jaguar_free_batch *fb);
+
+/*
+ * Directory index APIs
+ */
+int jaguar_dx_build(struct inode *dir);
+int jaguar_dx_lookup(struct inode *dir, const char *name, int *slot);
+int jaguar_dx_add(struct inode *dir, const char *name, int slot);
+int jaguar_dx_remove(struct inode *dir, const char *name, int slot);
+void jaguar_dx_drop(struct inode *dir);
+int jaguar_dx_free(struct super_block *sb, struct jaguar_inode_on_disk *jid,
+	struct jaguar_free_batch *fb);
+
+/*
+ * Mapping cache APIs
+ */
+#define JAGUAR_MCACHE_RUN		1024	/* blocks looked up on a miss */
+
+void jaguar_mcache_init(struct jaguar_inode *ji);
+int jaguar_mcache_lookup(struct inode *i, int logical, int max,
+	unsigned int *entry);
+unsigned int jaguar_mcache_seq(struct inode *i);
+void jaguar_mcache_insert(struct inode *i, int logical, unsigned int entry,
+	int len, unsigned int seq);
+void jaguar_mcache_update(struct inode *i, int logical, unsigned int entry,
+	int len);
+void jaguar_mcache_drop(struct inode *i);
+void jaguar_mcache_register(struct super_block *sb);
+void jaguar_mcache_unregister(struct super_block *sb);
 
 /*
  * Versioning APIs
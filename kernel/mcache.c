@@ -0,0 +1,311 @@
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/rbtree.h>
+#include <linux/shrinker.h>
+#include "jaguar.h"
+#include "debug.h"
+
+/*
+ * Mapping cache.
+ *
+ * Every inode keeps the runs of its block map that were looked up, in
+ * an rb-tree of (logical block, map entry, length) sorted by logical
+ * block. A lookup that hits the cache needs no indirect or extent block
+ * reads. Only mapped runs are cached, holes always go to the map.
+ *
+ * The cache is filled by lookup_blocks() after a miss, and kept up to
+ * date by update_inode_block_map(). A lookup that raced with an update
+ * of the map is not cached, which is what mc_seq is for.
+ *
+ * The inodes with cached runs are on a per super block list, which the
+ * shrinker empties, an inode at a time, under memory pressure.
+ * Lock order is jsb->mc_lock, then ji->mc_lock.
+ */
+
+struct jaguar_mcache_entry
+{
+	struct rb_node node;
+	int logical;
+	unsigned int entry;	/* map entry of 'logical', with its flags */
+	int len;
+};
+
+void jaguar_mcache_init(struct jaguar_inode *ji)
+{
+	spin_lock_init(&ji->mc_lock);
+	ji->mc_root = RB_ROOT;
+	ji->mc_count = 0;
+	ji->mc_seq = 0;
+	INIT_LIST_HEAD(&ji->mc_list);
+}
+
+/* the last run starting at or before 'logical', or NULL */
+static struct jaguar_mcache_entry *mc_find(struct jaguar_inode *ji, int logical)
+{
+	struct rb_node *n = ji->mc_root.rb_node;
+	struct jaguar_mcache_entry *e, *found = NULL;
+
+	while (n) {
+		e = rb_entry(n, struct jaguar_mcache_entry, node);
+		if (e->logical <= logical) {
+			found = e;
+			n = n->rb_right;
+		} else {
+			n = n->rb_left;
+		}
+	}
+
+	return found;
+}
+
+static void mc_erase(struct jaguar_super_block *jsb, struct jaguar_inode *ji,
+	struct jaguar_mcache_entry *e)
+{
+	rb_erase(&e->node, &ji->mc_root);
+	kfree(e);
+	ji->mc_count--;
+	atomic_dec(&jsb->mc_count);
+}
+
+/* forget the runs overlapping [logical, logical + len) */
+static void mc_forget(struct jaguar_super_block *jsb, struct jaguar_inode *ji,
+	int logical, int len)
+{
+	struct rb_node *n;
+	struct jaguar_mcache_entry *e;
+
+	e = mc_find(ji, logical);
+	n = e ? &e->node : rb_first(&ji->mc_root);
+
+	while (n) {
+		e = rb_entry(n, struct jaguar_mcache_entry, node);
+		if (e->logical >= logical + len)
+			break;
+		n = rb_next(n);
+		if (e->logical + e->len > logical)
+			mc_erase(jsb, ji, e);
+	}
+}
+
+/* add a run. it must not overlap any cached run. the run is merged
+ * into its neighbours if it continues them, else 'new' is used.
+ * returns 'new' if it was not needed.
+ */
+static struct jaguar_mcache_entry *mc_add(struct jaguar_super_block *jsb,
+	struct jaguar_inode *ji, int logical, unsigned int entry, int len,
+	struct jaguar_mcache_entry *new)
+{
+	struct rb_node **p = &ji->mc_root.rb_node, *parent = NULL, *n;
+	struct jaguar_mcache_entry *prev, *next;
+
+	prev = mc_find(ji, logical);
+	n = prev ? rb_next(&prev->node) : rb_first(&ji->mc_root);
+	next = n ? rb_entry(n, struct jaguar_mcache_entry, node) : NULL;
+
+	if (prev && prev->logical + prev->len == logical &&
+	    prev->entry + prev->len == entry) {
+		prev->len += len;
+		if (next && next->logical == logical + len &&
+		    next->entry == entry + len) {
+			prev->len += next->len;
+			mc_erase(jsb, ji, next);
+		}
+		return new;
+	}
+
+	if (next && next->logical == logical + len && next->entry == entry + len) {
+		next->logical = logical;
+		next->entry = entry;
+		next->len += len;
+		return new;
+	}
+
+	if (!new)
+		return NULL;
+
+	while (*p) {
+		parent = *p;
+		if (logical < rb_entry(parent, struct jaguar_mcache_entry, node)->logical)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	new->logical = logical;
+	new->entry = entry;
+	new->len = len;
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, &ji->mc_root);
+	ji->mc_count++;
+	atomic_inc(&jsb->mc_count);
+
+	return NULL;
+}
+
+/* put the inode on the list the shrinker works from */
+static void mc_track(struct jaguar_super_block *jsb, struct jaguar_inode *ji)
+{
+	spin_lock(&jsb->mc_lock);
+	if (list_empty(&ji->mc_list))
+		list_add_tail(&ji->mc_list, &jsb->mc_inodes);
+	spin_unlock(&jsb->mc_lock);
+}
+
+/* look up 'logical' in the cache. returns the num of blocks, up to
+ * 'max', mapped contiguously from 'logical' on, with the entry of the
+ * first in 'entry'. returns 0 if it is not cached.
+ */
+int jaguar_mcache_lookup(struct inode *i, int logical, int max,
+	unsigned int *entry)
+{
+	int n = 0;
+	struct jaguar_inode *ji = (struct jaguar_inode *)i->i_private;
+	struct jaguar_mcache_entry *e;
+
+	spin_lock(&ji->mc_lock);
+	e = mc_find(ji, logical);
+	if (e && logical < e->logical + e->len) {
+		*entry = e->entry + (logical - e->logical);
+		n = min(e->len - (logical - e->logical), max);
+	}
+	spin_unlock(&ji->mc_lock);
+
+	return n;
+}
+
+/* to be read before looking up the map on disk, and handed to
+ * jaguar_mcache_insert() with the result.
+ */
+unsigned int jaguar_mcache_seq(struct inode *i)
+{
+	unsigned int seq;
+	struct jaguar_inode *ji = (struct jaguar_inode *)i->i_private;
+
+	spin_lock(&ji->mc_lock);
+	seq = ji->mc_seq;
+	spin_unlock(&ji->mc_lock);
+
+	return seq;
+}
+
+/* cache a run just looked up in the map. it is dropped if the map was
+ * updated since 'seq' was read, as the run may be stale.
+ */
+void jaguar_mcache_insert(struct inode *i, int logical, unsigned int entry,
+	int len, unsigned int seq)
+{
+	struct jaguar_inode *ji = (struct jaguar_inode *)i->i_private;
+	struct jaguar_super_block *jsb = i->i_sb->s_fs_info;
+	struct jaguar_mcache_entry *new;
+
+	new = kmalloc(sizeof(*new), GFP_NOFS);
+
+	spin_lock(&ji->mc_lock);
+	if (ji->mc_seq == seq) {
+		mc_forget(jsb, ji, logical, len);
+		new = mc_add(jsb, ji, logical, entry, len, new);
+	}
+	spin_unlock(&ji->mc_lock);
+
+	if (new)
+		kfree(new);
+	mc_track(jsb, ji);
+}
+
+/* the map of [logical, logical + len) changed to the blocks from
+ * 'entry' on. an 'entry' of 0 just forgets the range.
+ */
+void jaguar_mcache_update(struct inode *i, int logical, unsigned int entry,
+	int len)
+{
+	struct jaguar_inode *ji = (struct jaguar_inode *)i->i_private;
+	struct jaguar_super_block *jsb = i->i_sb->s_fs_info;
+	struct jaguar_mcache_entry *new = NULL;
+
+	if (entry)
+		new = kmalloc(sizeof(*new), GFP_NOFS);
+
+	spin_lock(&ji->mc_lock);
+	ji->mc_seq++;
+	mc_forget(jsb, ji, logical, len);
+	if (entry)
+		new = mc_add(jsb, ji, logical, entry, len, new);
+	spin_unlock(&ji->mc_lock);
+
+	if (new)
+		kfree(new);
+	if (entry)
+		mc_track(jsb, ji);
+}
+
+/* free all runs of an inode. returns how many there were */
+static int mc_free_all(struct jaguar_super_block *jsb, struct jaguar_inode *ji)
+{
+	int n = 0;
+	struct rb_node *node;
+
+	spin_lock(&ji->mc_lock);
+	while ((node = rb_first(&ji->mc_root)) != NULL) {
+		mc_erase(jsb, ji, rb_entry(node, struct jaguar_mcache_entry, node));
+		n++;
+	}
+	spin_unlock(&ji->mc_lock);
+
+	return n;
+}
+
+/* drop the cache of an inode being evicted */
+void jaguar_mcache_drop(struct inode *i)
+{
+	struct jaguar_inode *ji = (struct jaguar_inode *)i->i_private;
+	struct jaguar_super_block *jsb = i->i_sb->s_fs_info;
+
+	spin_lock(&jsb->mc_lock);
+	list_del_init(&ji->mc_list);
+	mc_free_all(jsb, ji);
+	spin_unlock(&jsb->mc_lock);
+}
+
+/* empty the caches of the inodes that were cached longest ago, till
+ * 'nr_to_scan' runs are freed. returns the num of runs left.
+ */
+static int mcache_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	int nr = sc->nr_to_scan;
+	struct jaguar_super_block *jsb =
+		container_of(s, struct jaguar_super_block, mc_shrinker);
+	struct jaguar_inode *ji;
+
+	if (nr > 0) {
+		spin_lock(&jsb->mc_lock);
+		while (nr > 0 && !list_empty(&jsb->mc_inodes)) {
+			ji = list_first_entry(&jsb->mc_inodes,
+					struct jaguar_inode, mc_list);
+			list_del_init(&ji->mc_list);
+			nr -= mc_free_all(jsb, ji);
+		}
+		spin_unlock(&jsb->mc_lock);
+	}
+
+	return atomic_read(&jsb->mc_count);
+}
+
+void jaguar_mcache_register(struct super_block *sb)
+{
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+
+	spin_lock_init(&jsb->mc_lock);
+	INIT_LIST_HEAD(&jsb->mc_inodes);
+	atomic_set(&jsb->mc_count, 0);
+
+	jsb->mc_shrinker.shrink = mcache_shrink;
+	jsb->mc_shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&jsb->mc_shrinker);
+}
+
+void jaguar_mcache_unregister(struct super_block *sb)
+{
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+
+	unregister_shrinker(&jsb->mc_shrinker);
+}
@@ -0,0 +1,313 @@
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include "jaguar.h"
+#include "debug.h"
+
+/*
+ * Unlinked inodes are not freed by unlink itself. They are put on the
+ * orphan list, a chain of inodes on disk starting at the super block's
+ * orphan_head and linked both ways through next_orphan and prev_orphan,
+ * so that an inode is taken off it without a walk. Once the last reference
+ * to the inode goes away, evict queues it for the free worker, which
+ * frees its blocks and takes it off the list. Orphans still on the list
+ * at mount time are from a crash, and are freed then.
+ *
+ * The links are only ever changed on disk, through the helpers below,
+ * never through the inode's in-core copy. Images from before prev_orphan
+ * have it 0, it is set right by the walk at mount.
+ */
+
+/* read the on-disk inode 'inum'. the caller brelse's 'bh' */
+static struct jaguar_inode_on_disk *get_disk_inode(struct super_block *sb,
+	int inum, struct buffer_head **bh)
+{
+	int block;
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+
+	block = SB_LAYOUT_BLOCK(jsb->disk_copy, inode_tbl_start) + INUM_TO_BLOCK(inum);
+	if ((*bh = __bread(sb->s_bdev, block, JAGUAR_BLOCK_SIZE)) == NULL) {
+		ERR("error reading inode from disk\n");
+		return NULL;
+	}
+
+	return (struct jaguar_inode_on_disk *)((*bh)->b_data + INUM_TO_OFFSET(inum));
+}
+
+int jaguar_orphan_next(struct super_block *sb, int inum)
+{
+	int ret;
+	struct buffer_head *bh;
+	struct jaguar_inode_on_disk *jid;
+
+	if ((jid = get_disk_inode(sb, inum, &bh)) == NULL)
+		return -EIO;
+
+	ret = jid->next_orphan;
+	brelse(bh);
+
+	return ret;
+}
+
+static int set_next_orphan(struct super_block *sb, int inum, int next)
+{
+	struct buffer_head *bh;
+	struct jaguar_inode_on_disk *jid;
+
+	if ((jid = get_disk_inode(sb, inum, &bh)) == NULL)
+		return -EIO;
+
+	jid->next_orphan = next;
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	return 0;
+}
+
+static int set_prev_orphan(struct super_block *sb, int inum, int prev)
+{
+	struct buffer_head *bh;
+	struct jaguar_inode_on_disk *jid;
+
+	if ((jid = get_disk_inode(sb, inum, &bh)) == NULL)
+		return -EIO;
+
+	jid->prev_orphan = prev;
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	return 0;
+}
+
+static int set_orphan_links(struct super_block *sb, int inum, int prev,
+	int next)
+{
+	struct buffer_head *bh;
+	struct jaguar_inode_on_disk *jid;
+
+	if ((jid = get_disk_inode(sb, inum, &bh)) == NULL)
+		return -EIO;
+
+	jid->prev_orphan = prev;
+	jid->next_orphan = next;
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	return 0;
+}
+
+/* put an unlinked inode at the head of the orphan list */
+int jaguar_orphan_add(struct inode *i)
+{
+	int ret, head;
+	struct super_block *sb = i->i_sb;
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+
+	DBG("jaguar_orphan_add: inum=%d\n", (int)i->i_ino);
+
+	mutex_lock(&jsb->orphan_lock);
+	head = jsb->disk_copy->orphan_head;
+	ret = set_orphan_links(sb, i->i_ino, 0, head);
+	if (ret == 0 && head > 0)
+		ret = set_prev_orphan(sb, head, i->i_ino);
+	if (ret == 0) {
+		jsb->disk_copy->orphan_head = i->i_ino;
+		mark_buffer_dirty(jsb->bh);
+	}
+	mutex_unlock(&jsb->orphan_lock);
+
+	return ret;
+}
+
+/* take an inode off the orphan list */
+static int orphan_del(struct super_block *sb, int inum)
+{
+	int ret = 0, prev, next;
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+	struct buffer_head *bh;
+	struct jaguar_inode_on_disk *jid;
+
+	mutex_lock(&jsb->orphan_lock);
+
+	if ((jid = get_disk_inode(sb, inum, &bh)) == NULL) {
+		ret = -EIO;
+		goto out;
+	}
+	prev = jid->prev_orphan;
+	next = jid->next_orphan;
+	brelse(bh);
+
+	/* the links must agree, or the list is not touched */
+	if ((prev == 0 && jsb->disk_copy->orphan_head != inum) ||
+	    (prev > 0 && jaguar_orphan_next(sb, prev) != inum)) {
+		ERR("inode %d not on the orphan list\n", inum);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (prev == 0) {
+		jsb->disk_copy->orphan_head = next;
+		mark_buffer_dirty(jsb->bh);
+	} else if ((ret = set_next_orphan(sb, prev, next))) {
+		goto out;
+	}
+
+	if (next > 0 && (ret = set_prev_orphan(sb, next, prev)))
+		goto out;
+
+	ret = set_orphan_links(sb, inum, 0, 0);
+
+out:
+	mutex_unlock(&jsb->orphan_lock);
+	return ret;
+}
+
+/* free the blocks and the inode of an orphan */
+static void free_orphan(struct super_block *sb, int inum)
+{
+	struct buffer_head *bh;
+	struct jaguar_inode_on_disk *jid, copy;
+
+	DBG("free_orphan: entering, inum=%d\n", inum);
+
+	if ((jid = get_disk_inode(sb, inum, &bh)) == NULL)
+		return;
+	memcpy(&copy, jid, sizeof(copy));
+	brelse(bh);
+
+	/* a zeroed inode had its blocks freed already, before a crash */
+	if (copy.type != 0 && free_inode_blocks(sb, &copy))
+		ERR("could not free all data blocks of inode %d\n", inum);
+
+	/* clear out the inode info on disk, but keep it linked */
+	if ((jid = get_disk_inode(sb, inum, &bh)) == NULL)
+		return;
+	memset(jid, 0, sizeof(*jid));
+	jid->next_orphan = copy.next_orphan;
+	jid->prev_orphan = copy.prev_orphan;
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	if (orphan_del(sb, inum))
+		return;
+
+	/* update the inode bitmap and group counters */
+	if (jaguar_group_free_inode(sb, inum))
+		ERR("error updating inode bitmap\n");
+}
+
+static void orphan_work_fn(struct work_struct *work)
+{
+	struct jaguar_super_block *jsb =
+		container_of(work, struct jaguar_super_block, orphan_work);
+	struct jaguar_orphan *o;
+
+	spin_lock(&jsb->lock);
+	while (!list_empty(&jsb->orphan_queue)) {
+		o = list_first_entry(&jsb->orphan_queue, struct jaguar_orphan, list);
+		list_del(&o->list);
+		spin_unlock(&jsb->lock);
+
+		free_orphan(jsb->sb, o->inum);
+
+		spin_lock(&jsb->lock);
+		jsb->n_blocks_pending -= o->n_blocks;
+		kfree(o);
+	}
+	spin_unlock(&jsb->lock);
+}
+
+/* hand an orphan to the free worker. if that is not possible, it stays
+ * on the orphan list, and is freed at the next mount.
+ */
+void jaguar_orphan_queue(struct super_block *sb, int inum, int n_blocks)
+{
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+	struct jaguar_orphan *o;
+
+	DBG("jaguar_orphan_queue: inum=%d, n_blocks=%d\n", inum, n_blocks);
+
+	if ((o = kmalloc(sizeof(*o), GFP_NOFS)) == NULL) {
+		ERR("no memory, inode %d is freed at next mount\n", inum);
+		return;
+	}
+	o->inum = inum;
+	o->n_blocks = n_blocks;
+
+	spin_lock(&jsb->lock);
+	list_add_tail(&o->list, &jsb->orphan_queue);
+	jsb->n_blocks_pending += n_blocks;
+	spin_unlock(&jsb->lock);
+
+	queue_work(jsb->orphan_wq, &jsb->orphan_work);
+}
+
+/* start the free worker, and queue the orphans left by a crash */
+int jaguar_orphan_init(struct super_block *sb)
+{
+	int inum, next, prev, n, n_blocks;
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+	struct buffer_head *bh;
+	struct jaguar_inode_on_disk *jid;
+
+	jsb->sb = sb;
+	mutex_init(&jsb->orphan_lock);
+	INIT_LIST_HEAD(&jsb->orphan_queue);
+	INIT_WORK(&jsb->orphan_work, orphan_work_fn);
+
+	if ((jsb->orphan_wq = alloc_workqueue("jaguarfs-free",
+			WQ_MEM_RECLAIM | WQ_UNBOUND, 1)) == NULL) {
+		ERR("could not create workqueue\n");
+		return -ENOMEM;
+	}
+
+	/* a list longer than the num of inodes has a loop in it. the
+	 * orphans are then left alone, rather than freed twice.
+	 */
+	n = 0;
+	inum = jsb->disk_copy->orphan_head;
+	while (inum > 0 && n <= jsb->disk_copy->n_inodes) {
+		if ((inum = jaguar_orphan_next(sb, inum)) < 0)
+			break;
+		n++;
+	}
+	if (n > jsb->disk_copy->n_inodes) {
+		ERR("the orphan list loops, orphans are not freed\n");
+		return 0;
+	}
+
+	prev = 0;
+	inum = jsb->disk_copy->orphan_head;
+	while (inum > 0) {
+		if ((jid = get_disk_inode(sb, inum, &bh)) == NULL)
+			break;
+		n_blocks = (JAGUAR_I_SIZE(jid) + JAGUAR_BLOCK_SIZE - 1) / JAGUAR_BLOCK_SIZE;
+		next = jid->next_orphan;
+		if (jid->prev_orphan != prev) {
+			jid->prev_orphan = prev;
+			mark_buffer_dirty(bh);
+		}
+		brelse(bh);
+
+		DBG("jaguar_orphan_init: found orphan %d\n", inum);
+		jaguar_orphan_queue(sb, inum, n_blocks);
+		prev = inum;
+		inum = next;
+	}
+
+	return 0;
+}
+
+/* wait for the worker to free everything queued, and stop it */
+void jaguar_orphan_exit(struct super_block *sb)
+{
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+
+	if (!jsb->orphan_wq)
+		return;
+
+	flush_workqueue(jsb->orphan_wq);
+	destroy_workqueue(jsb->orphan_wq);
+	jsb->orphan_wq = NULL;
+}
@@ -42,6 +42,7 @@ static int read_sb(struct super_block *sb)
 fail:
 	if (jsb)
 		kfree(jsb);
+	sb->s_fs_info = NULL;
 
 	return ret;
 }
@@ -61,8 +62,17 @@ static void jaguar_put_super(struct super_block *sb)
 
 	jsb = (struct jaguar_super_block *)sb->s_fs_info;
 
+	jaguar_mcache_unregister(sb);
+	jaguar_orphan_exit(sb);
+	jaguar_end_io_exit(sb);
+	jaguar_prealloc_unregister(sb);
+	discard_all_prealloc(sb);
+	jaguar_put_groups(sb);
+
 	/* now release the buffer head of the super block */
 	brelse(jsb->bh);
+	kfree(jsb);
+	sb->s_fs_info = NULL;
 }
 
 static int jaguar_statfs(struct dentry *d, struct kstatfs *stat)
@@ -82,11 +92,17 @@ static int jaguar_statfs(struct dentry *d, struct kstatfs *stat)
 	stat->f_type = JAGUAR_MAGIC;
 	stat->f_bsize = sb->s_blocksize;
 	stat->f_blocks = jsbd->n_blocks;
-	stat->f_bfree = jsbd->n_blocks_free;
-	stat->f_bavail = jsbd->n_blocks_free;
 	stat->f_files = jsbd->n_inodes;
+
+	/* blocks of unlinked inodes not freed yet by the worker count as
+	 * free, but not as available.
+	 */
+	spin_lock(&jsb->lock);
+	stat->f_bavail = jsbd->n_blocks_free - jsb->n_blocks_reserved;
+	stat->f_bfree = stat->f_bavail + jsb->n_blocks_pending;
 	stat->f_ffree = jsbd->n_inodes_free;
-	stat->f_namelen = strlen(jsbd->name);
+	spin_unlock(&jsb->lock);
+	stat->f_namelen = JAGUAR_NAME_LEN(jsbd);
 	stat->f_fsid.val[0] = (u32)id;
 	stat->f_fsid.val[1] = (u32)(id >> 32);
 
@@ -95,6 +111,7 @@ static int jaguar_statfs(struct dentry *d, struct kstatfs *stat)
 
 const struct super_operations jaguar_sops = {
 	.write_inode		= jaguar_write_inode,
+	.evict_inode		= jaguar_evict_inode,
 	.put_super		= jaguar_put_super,
 	.statfs			= jaguar_statfs
 };
@@ -107,6 +124,7 @@ int jaguar_fill_super(struct super_block *sb, void *data, int silent)
 {
 	int ret = -EINVAL;
 	struct inode *root_inode = NULL;
+	struct jaguar_super_block *jsb;
 
 	DBG("jaguar_fill_super: entering\n");
 
@@ -124,32 +142,75 @@ int jaguar_fill_super(struct super_block *sb, void *data, int silent)
 		goto fail;
 	}
 
+	/* files past 2 GB need the 64 bit layout */
+	jsb = sb->s_fs_info;
+	if (jsb->disk_copy->features & JAGUAR_FEATURE_64BIT)
+		sb->s_maxbytes = (loff_t)JAGUAR_MAX_FILE_BLOCKS * JAGUAR_BLOCK_SIZE;
+
+	jaguar_mcache_register(sb);
+
+	/* read the allocation groups */
+	if ((ret = jaguar_load_groups(sb))) {
+		ERR("error reading allocation groups from disk\n");
+		goto fail_mcache;
+	}
+	jaguar_prealloc_register(sb);
+
+	/* start the worker that converts unwritten blocks after writes */
+	if ((ret = jaguar_end_io_init(sb))) {
+		ERR("error starting the end io worker\n");
+		goto fail_groups;
+	}
+
+	/* start the free worker. orphans left from before are freed */
+	if ((ret = jaguar_orphan_init(sb))) {
+		ERR("error starting the free worker\n");
+		goto fail_end_io;
+	}
+
 	/* setup the super block magic and ops */
 	sb->s_magic = JAGUAR_MAGIC;
 	sb->s_op = &jaguar_sops;
 
 	/* create the root dir inode of the fs */
 	root_inode = jaguar_iget(sb, 1);
-	if (IS_ERR(root_inode)) {
+	if (!root_inode) {
 		ERR("error allocating root inode\n");
-		ret = PTR_ERR(root_inode);
-		goto fail;
+		ret = -EIO;
+		goto fail_orphan;
 	}
 
 	/* TODO: is this required? */
 	set_nlink(root_inode, 2);
 
 	/* setup the dentry of the root dir in super block */
+	/* d_make_root() puts the inode if it fails */
 	sb->s_root = d_make_root(root_inode);
 	if (!sb->s_root) {
 		ERR("d_make_root failed\n");
-		goto fail;
+		ret = -ENOMEM;
+		goto fail_orphan;
 	}
 
 	return 0;
 
+	/* put_super is not called for a mount that failed, so undo here
+	 * whatever was set up.
+	 */
+fail_orphan:
+	jaguar_orphan_exit(sb);
+fail_end_io:
+	jaguar_end_io_exit(sb);
+fail_groups:
+	jaguar_prealloc_unregister(sb);
+	discard_all_prealloc(sb);
+	jaguar_put_groups(sb);
+fail_mcache:
+	jaguar_mcache_unregister(sb);
+	brelse(jsb->bh);
+	kfree(jsb);
+	sb->s_fs_info = NULL;
 fail:
-
 	return ret;
 }
 
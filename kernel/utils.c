@@ -3,142 +3,247 @@
 #include "jaguar.h"
 #include "debug.h"
 
-int jaguar_find_first_zero_bit(void *buf, int size)
+/* count the free bits in [lo, hi) of a bitmap on disk.
+ * the range must lie within one bitmap block.
+ */
+int jaguar_bmap_count_free(struct super_block *sb, struct jaguar_bmap *bmap,
+	int lo, int hi)
 {
-	int ret, i = 0;
-	unsigned char mask, *bmap = (unsigned char *)buf;
-
-	/* find 1st byte with a 0 bit */
-	while (i < size && *(bmap + i) == 0xFF)
-		i++;
+	int block, base, ret;
+	struct buffer_head *bh;
 
-	if (i == size)
-		return -1;
+	block = lo / NUM_BITS_PER_BLOCK;
+	base = block * NUM_BITS_PER_BLOCK;
+	BUG_ON(hi <= lo || (hi - 1) / NUM_BITS_PER_BLOCK != block);
 
-	ret = i * 8;
-	mask = 0x80;
-	while ( *(bmap + i) & mask) {
-		mask = mask >> 1;
-		ret++;
+	/* read bitmap from disk */
+	if ((bh = __bread(sb->s_bdev, bmap->start + block,
+			JAGUAR_BLOCK_SIZE)) == NULL) {
+		ERR("error reading bmap from disk\n");
+		return -EIO;
 	}
 
-	//DBG("jaguar_find_first_zero_bit: returning %d\n", ret);
+	ret = (hi - lo) - (jaguar_bitmap_weight(bh->b_data, hi - base) -
+		jaguar_bitmap_weight(bh->b_data, lo - base));
+	brelse(bh);
+
 	return ret;
 }
 
-void jaguar_set_bit(void *buf, int pos)
+/* where the search for a free run at 'start' goes on, given the
+ * preallocation windows on 'windows'. if a window covers 'start', the
+ * end of the window is returned. otherwise 'start' is returned, and
+ * 'end' is cut back to the first window after it.
+ */
+static int skip_windows(struct super_block *sb, struct list_head *windows,
+	int start, int *end)
 {
-	int byte, bit;
-	unsigned char mask, *bmap = (unsigned char *)buf;
+	int next = start;
+	struct jaguar_super_block *jsb = sb->s_fs_info;
+	struct jaguar_inode *ji;
 
-	byte = pos / 8;
-	bit = pos % 8;
-	mask = 0x80;
-	while (bit--)
-		mask = mask >> 1;
+	spin_lock(&jsb->lock);
+	list_for_each_entry(ji, windows, pa_group_list) {
+		if (ji->pa_start >= *end || ji->pa_start + ji->pa_len <= start)
+			continue;
+		if (ji->pa_start <= start) {
+			if (ji->pa_start + ji->pa_len > next)
+				next = ji->pa_start + ji->pa_len;
+		} else
+			*end = ji->pa_start;
+	}
+	spin_unlock(&jsb->lock);
 
-	//DBG("jaguar_set_bit: pos=%d, byte=%d, mask=0x%x\n", pos, byte, mask);
-	bmap[byte] |= mask;
+	return next;
 }
 
-void jaguar_clear_bit(void *buf, int pos)
+/* search the bitmap block 'data', whose first bit is 'base', for a run
+ * as described at jaguar_bmap_find_run(). returns the first bit of the
+ * run, or -1.
+ */
+static int bmap_search(struct super_block *sb, const void *data, int base,
+	int from, int hi, int min, int max, int *count,
+	struct list_head *windows)
 {
-	int byte, bit;
-	unsigned char mask, *bmap = (unsigned char *)buf;
+	int start, end, next;
+
+	start = from - base;
+	while ((start = jaguar_find_zero_run(data, hi - base, start, min)) >= 0) {
+		end = jaguar_find_next_set_bit(data, hi - base, start);
+		if (end < 0)
+			end = hi - base;
+
+		if (windows) {
+			end += base;
+			next = skip_windows(sb, windows, start + base, &end);
+			end -= base;
+			if (next != start + base) {
+				start = next - base;
+				continue;
+			}
+			if (end - start < min) {
+				start = end;
+				continue;
+			}
+		}
 
-	byte = pos / 8;
-	bit = pos % 8;
-	mask = 0x80;
-	while (bit--)
-		mask = mask >> 1;
+		if (end - start > max)
+			end = start + max;
+		*count = end - start;
+		return start + base;
+	}
 
-	//DBG("jaguar_clear_bit: pos=%d, byte=%d, mask=0x%x\n", pos, byte, mask);
-	bmap[byte] &= ~mask;
+	return -1;
 }
 
-/* allocate a bit from a bitmap on disk.
- * bdev:	block dev where the bmap resides
- * bmap_start: 	start block of the bitmap
- * bmap_size:	num blocks the bitmap occupies
- * start:	hint on which block to start from, relative to bmap_start.
- * 		ie, if bmap_start = 10, and start = 1, the function
- * 		would start searching from phys block 11.
+/* find a run of contiguous free bits in a bitmap on disk.
+ * bmap:	the bitmap
+ * lo, hi:	range of bits to search. the range must lie within
+ * 		one bitmap block, so exactly one block is read from disk.
+ * goal:	bit to start searching from. the run starts exactly at
+ * 		goal if goal is free. the search wraps around to 'lo'.
+ * min, max:	the run is at least 'min' and at most 'max' bits long.
+ * count:	returns the length of the run found.
+ * windows:	preallocation windows of the range, whose bits are free
+ * 		on disk but are passed over. may be NULL.
+ *
+ * returns the first bit of the run, or -ENOSPC if there is no run of
+ * 'min' free bits in the range. the bits are left as they are.
  */
-int jaguar_bmap_alloc_bit(struct block_device *bdev,
-	int bmap_start, int bmap_size, int start)
+int jaguar_bmap_find_run(struct super_block *sb, struct jaguar_bmap *bmap,
+	int lo, int hi, int goal, int min, int max, int *count,
+	struct list_head *windows)
 {
-	int block, ret, found = 0, bit;
+	int block, base, ret;
 	struct buffer_head *bh = NULL;
 
-	DBG("jaguar_bmap_alloc_bit: entering bmap_start=%d, bmap_size=%d, start=%d\n",
-		bmap_start, bmap_size, start);
-
-	block = start;
-	do {
-		/* read bitmap from disk */
-		if ((bh = __bread(bdev, bmap_start + block, 
-				JAGUAR_BLOCK_SIZE)) == NULL) {
-			ERR("error reading inode bmap from disk\n");
-			ret = -EIO;
-			goto fail;
-		}
+	DBG("jaguar_bmap_find_run: entering bmap_start=%d, range=%d-%d, goal=%d, min=%d, max=%d\n",
+		bmap->start, lo, hi, goal, min, max);
 
-		ret = (int)jaguar_find_first_zero_bit(bh->b_data, JAGUAR_BLOCK_SIZE);
-		if (ret >= 0) {
-			found = 1;
-			break;
-		}
+	block = lo / NUM_BITS_PER_BLOCK;
+	base = block * NUM_BITS_PER_BLOCK;
+	BUG_ON(hi <= lo || (hi - 1) / NUM_BITS_PER_BLOCK != block);
+
+	if (goal < lo || goal >= hi)
+		goal = lo;
+
+	/* read bitmap from disk */
+	if ((bh = __bread(sb->s_bdev, bmap->start + block,
+			JAGUAR_BLOCK_SIZE)) == NULL) {
+		ERR("error reading bmap from disk\n");
+		ret = -EIO;
+		goto fail;
+	}
+
+	/* search from the goal, and wrap around to the start of the
+	 * range if nothing fits after it.
+	 */
+	ret = bmap_search(sb, bh->b_data, base, goal, hi, min, max, count, windows);
+	if (ret < 0)
+		ret = bmap_search(sb, bh->b_data, base, lo, hi, min, max, count,
+				windows);
+	if (ret < 0) {
+		DBG("no run of %d free bits in range\n", min);
+		ret = -ENOSPC;
+		goto fail;
+	}
 
-		block = (block + 1) % bmap_size;
-		DBG("moving to next block %d\n", block);
+	DBG("jaguar_bmap_find_run: found bits %d-%d\n", ret, ret + *count - 1);
 
+fail:
+	if (bh)
 		brelse(bh);
-		bh = NULL;
+	return ret;
+}
 
-	} while (block != start);
+/* mark the 'count' bits from 'start' on as allocated. they must be free,
+ * and lie within one bitmap block.
+ */
+int jaguar_bmap_set_run(struct super_block *sb, struct jaguar_bmap *bmap,
+	int start, int count)
+{
+	int ret = 0, block, base, set;
+	struct buffer_head *bh = NULL;
 
-	if (!found) {
-		ERR("could not find free bit in bmap\n");
-		ret = -ENOMEM;
+	block = start / NUM_BITS_PER_BLOCK;
+	base = block * NUM_BITS_PER_BLOCK;
+	BUG_ON(count <= 0 || (start + count - 1) / NUM_BITS_PER_BLOCK != block);
+
+	/* read bitmap from disk */
+	if ((bh = __bread(sb->s_bdev, bmap->start + block,
+			JAGUAR_BLOCK_SIZE)) == NULL) {
+		ERR("error reading bmap from disk\n");
+		ret = -EIO;
 		goto fail;
 	}
 
-	/* mark the bmap bit as allocated */
-	jaguar_set_bit(bh->b_data, ret);
-	mark_buffer_dirty(bh);
+	set = jaguar_find_next_set_bit(bh->b_data, start + count - base,
+			start - base);
+	if (set >= 0) {
+		ERR("bit %d is already in use\n", set + base);
+		ret = -EINVAL;
+		goto fail;
+	}
 
-	/* 'ret' is the first free bit in the _current_ bmap block.
-	 * it may not be the bit offset (since current bmap block may not
-	 * be the first).
-	 */
-	bit = block * NUM_BITS_PER_BLOCK + ret;
-	DBG("jaguar_bmap_alloc_bit: found bit %d\n", bit);
-	ret = bit;
+	/* mark the bmap bits as allocated */
+	jaguar_set_bits(bh->b_data, start - base, count);
+	mark_buffer_dirty(bh);
 
 fail:
 	if (bh)
 		brelse(bh);
 	return ret;
+}
 
+/* allocate a run of contiguous bits from a bitmap on disk, found as by
+ * jaguar_bmap_find_run() with no windows.
+ * returns the first bit of the run, with its length in 'count', or < 0.
+ */
+int jaguar_bmap_alloc_run(struct super_block *sb, struct jaguar_bmap *bmap,
+	int lo, int hi, int goal, int min, int max, int *count)
+{
+	int ret, err;
+
+	ret = jaguar_bmap_find_run(sb, bmap, lo, hi, goal, min, max, count, NULL);
+	if (ret < 0)
+		return ret;
+
+	if ((err = jaguar_bmap_set_run(sb, bmap, ret, *count)))
+		return err;
+
+	return ret;
 }
 
-int jaguar_bmap_free_bit(struct block_device *bdev, int bmap_start, int bit)
+int jaguar_bmap_free_bit(struct super_block *sb, struct jaguar_bmap *bmap,
+	int bit)
 {
 	int ret = 0, block, offset;
 	struct buffer_head *bh = NULL;
 
-	DBG("jaguar_bmap_free_bit: entering bmap_start=%d, bit=%d\n", bmap_start, bit);
+	DBG("jaguar_bmap_free_bit: entering bmap_start=%d, bit=%d\n", bmap->start, bit);
+
+	if (bit <= 0 || bit >= bmap->nbits) {
+		ERR("freeing invalid bit %d\n", bit);
+		ret = -EINVAL;
+		goto fail;
+	}
 
 	/* read bitmap from disk */
-	block = bmap_start + (bit / NUM_BITS_PER_BLOCK);
-	if ((bh = __bread(bdev, block, JAGUAR_BLOCK_SIZE)) == NULL) {
-		ERR("error reading inode bmap from disk\n");
+	block = bit / NUM_BITS_PER_BLOCK;
+	if ((bh = __bread(sb->s_bdev, bmap->start + block,
+			JAGUAR_BLOCK_SIZE)) == NULL) {
+		ERR("error reading bmap from disk\n");
 		ret = -EIO;
 		goto fail;
 	}
 
 	/* mark the bit as free in the bmap */
 	offset = bit % NUM_BITS_PER_BLOCK;
+	if (!jaguar_test_bit(bh->b_data, offset)) {
+		ERR("bit %d is already free\n", bit);
+		ret = -EINVAL;
+		goto fail;
+	}
 	jaguar_clear_bit(bh->b_data, offset);
 	mark_buffer_dirty(bh);
 	DBG("jaguar_bmap_free_bit: freed bit %d\n", bit);
@@ -148,3 +253,61 @@ fail:
 		brelse(bh);
 	return ret;
 }
+
+/* free a sorted list of 'n' bits of a bitmap on disk.
+ * all bits must lie within one bitmap block, so that block is read
+ * once, and each run of consecutive bits is cleared in one go. bits
+ * that are out of range, or already free, are skipped.
+ * returns the num of bits freed, or < 0 if the bitmap could not be read.
+ */
+int jaguar_bmap_free_bits(struct super_block *sb, struct jaguar_bmap *bmap,
+	int *bits, int n)
+{
+	int ret = 0, block, base, j, start, len;
+	struct buffer_head *bh = NULL;
+
+	DBG("jaguar_bmap_free_bits: entering bmap_start=%d, bits=%d.., n=%d\n",
+		bmap->start, bits[0], n);
+
+	block = bits[0] / NUM_BITS_PER_BLOCK;
+	base = block * NUM_BITS_PER_BLOCK;
+	BUG_ON(bits[n - 1] / NUM_BITS_PER_BLOCK != block);
+
+	/* read bitmap from disk */
+	if ((bh = __bread(sb->s_bdev, bmap->start + block,
+			JAGUAR_BLOCK_SIZE)) == NULL) {
+		ERR("error reading bmap from disk\n");
+		ret = -EIO;
+		goto fail;
+	}
+
+	/* clear each run of consecutive bits */
+	for (j = 0; j < n; j += len) {
+		start = bits[j];
+		len = 1;
+		while (j + len < n && bits[j + len] == start + len)
+			len++;
+
+		/* a run with a bad bit is done a bit at a time */
+		if (start <= 0 || start + len > bmap->nbits ||
+		    jaguar_find_next_zero_bit(bh->b_data, start - base + len,
+				start - base) >= 0) {
+			len = 1;
+			if (start <= 0 || start >= bmap->nbits ||
+			    !jaguar_test_bit(bh->b_data, start - base)) {
+				ERR("bit %d is invalid or already free\n", start);
+				continue;
+			}
+		}
+
+		jaguar_clear_bits(bh->b_data, start - base, len);
+		ret += len;
+	}
+	if (ret)
+		mark_buffer_dirty(bh);
+
+fail:
+	if (bh)
+		brelse(bh);
+	return ret;
+}
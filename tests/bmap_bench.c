@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "../kernel/bitmap.h"
+
+#define BMAP_SIZE		4096
+#define NUM_BITS		(BMAP_SIZE * 8)
+#define DEFAULT_NUM_ITERATIONS	100000
+
+/* the byte at a time search jaguarfs used before the bitmap engine.
+ * kept here as the baseline.
+ */
+static int byte_find_first_zero_bit(void *buf, int size)
+{
+	int ret, i = 0;
+	unsigned char mask, *bmap = (unsigned char *)buf;
+
+	while (i < size && *(bmap + i) == 0xFF)
+		i++;
+
+	if (i == size)
+		return -1;
+
+	ret = i * 8;
+	mask = 0x80;
+	while ( *(bmap + i) & mask) {
+		mask = mask >> 1;
+		ret++;
+	}
+
+	return ret;
+}
+
+static int elapsed(struct timeval *before, struct timeval *after)
+{
+	return (after->tv_sec - before->tv_sec) * 1000000 +
+		(after->tv_usec - before->tv_usec);
+}
+
+static void report(const char *name, int time, int iterations)
+{
+	printf("%-24s total time = %f, rate = %.2f scans/sec\n", name,
+		(float)time/1000000, (float)iterations / time * 1000000);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char bmap[BMAP_SIZE];
+	int i, n, iterations = DEFAULT_NUM_ITERATIONS, sum = 0;
+	struct timeval tv_before, tv_after;
+
+	if (argc > 1)
+		iterations = strtol(argv[1], NULL, 10);
+
+	/* worst case for allocation: a full bitmap block with a single
+	 * free bit at the very end.
+	 */
+	memset(bmap, 0xFF, sizeof(bmap));
+	jaguar_clear_bit(bmap, NUM_BITS - 3);
+
+	if (byte_find_first_zero_bit(bmap, BMAP_SIZE) !=
+	    jaguar_find_first_zero_bit(bmap, NUM_BITS)) {
+		printf("mismatch between byte and word search\n");
+		return -1;
+	}
+
+	printf("starting bitmap test with %d iterations over %d bits\n",
+		iterations, NUM_BITS);
+
+	gettimeofday(&tv_before, NULL);
+	for (i = 0; i < iterations; i++) {
+		sum += byte_find_first_zero_bit(bmap, BMAP_SIZE);
+		__asm__ __volatile__("" : : "r"(bmap) : "memory");
+	}
+	gettimeofday(&tv_after, NULL);
+	report("byte find_first_zero", elapsed(&tv_before, &tv_after), iterations);
+
+	gettimeofday(&tv_before, NULL);
+	for (i = 0; i < iterations; i++) {
+		sum += jaguar_find_first_zero_bit(bmap, NUM_BITS);
+		__asm__ __volatile__("" : : "r"(bmap) : "memory");
+	}
+	gettimeofday(&tv_after, NULL);
+	report("word find_first_zero", elapsed(&tv_before, &tv_after), iterations);
+
+	/* fragmented bitmap: every 8th bit free, look for a run of 8 */
+	for (n = 0; n < NUM_BITS; n++) {
+		if (n % 8 == 7)
+			jaguar_clear_bit(bmap, n);
+		else
+			jaguar_set_bit(bmap, n);
+	}
+	jaguar_clear_bits(bmap, NUM_BITS - 8, 8);
+
+	gettimeofday(&tv_before, NULL);
+	for (i = 0; i < iterations / 100; i++) {
+		sum += jaguar_find_zero_run(bmap, NUM_BITS, 0, 8);
+		__asm__ __volatile__("" : : "r"(bmap) : "memory");
+	}
+	gettimeofday(&tv_after, NULL);
+	report("word find_zero_run", elapsed(&tv_before, &tv_after), iterations / 100);
+
+	gettimeofday(&tv_before, NULL);
+	for (i = 0; i < iterations; i++) {
+		sum += jaguar_bitmap_weight(bmap, NUM_BITS);
+		__asm__ __volatile__("" : : "r"(bmap) : "memory");
+	}
+	gettimeofday(&tv_after, NULL);
+	report("word bitmap_weight", elapsed(&tv_before, &tv_after), iterations);
+
+	/* keep the compiler from dropping the loops */
+	return sum == 0x7fffffff;
+}
@@ -11,6 +11,7 @@
 #define ACTION_PRUNE		3
 #define ACTION_DUMP		4
 #define ACTION_RESET		5
+#define ACTION_COMPACT		6
 
 static void usage(void)
 {
@@ -21,6 +22,7 @@ static void usage(void)
 		"prune		- Remove the older versions that are not needed\n"
 		"dump		- Dump statistics\n"
 		"reset		- Reset statistics\n"
+		"compact	- Repack the entries of DIR into fewer blocks\n"
 		"TYPE can be\n"
 		"all		- Keep all older versions\n"
 		"time		- Keep versions within last few seconds\n"
@@ -104,6 +106,29 @@ err:
 	return ret;
 }
 
+static int compact(const char *filename)
+{
+	int fd = -1, ret = -EINVAL;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		ret = errno;
+		perror(NULL);
+		goto err;
+	}
+
+	if ((ret = ioctl(fd, JAGUAR_IOC_COMPACT_DIR, NULL)) < 0) {
+		ret = errno;
+		perror(NULL);
+		goto err;
+	}
+
+err:
+	if (fd > 0)
+		close(fd);
+
+	return ret;
+}
+
 static int dump(const char *filename)
 {
 	int fd = -1, ret = -EINVAL;
@@ -170,6 +195,8 @@ int main(int argc, char **argv)
 				action = ACTION_DUMP;
 			} else if (strcmp(optarg, "reset") == 0) {
 				action = ACTION_RESET;
+			} else if (strcmp(optarg, "compact") == 0) {
+				action = ACTION_COMPACT;
 			} else {
 				usage();
 				exit(1);
@@ -212,6 +239,9 @@ int main(int argc, char **argv)
 	case ACTION_RESET:
 		ret = reset(argv[optind]);
 		break;
+	case ACTION_COMPACT:
+		ret = compact(argv[optind]);
+		break;
 	}
 
 	return ret;
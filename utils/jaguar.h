@@ -15,6 +15,7 @@
 #define JAGUAR_IOC_ROLLBACK_DIR		_IOW('f', 104, int)
 #define JAGUAR_IOC_RESET_STAT		_IO('f', 105)
 #define JAGUAR_IOC_DUMP_STAT		_IO('f', 106)
+#define JAGUAR_IOC_COMPACT_DIR		_IO('f', 107)
 
 /*
  * versioning types
@@ -9,7 +9,8 @@
 struct jaguar_dentry
 {
 	unsigned int inum;
-	char name[JAGUAR_FILENAME_MAX];
+	char name[JAGUAR_FILENAME_MAX - 1];
+	unsigned char file_type;
 };
 
 
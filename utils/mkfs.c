@@ -3,10 +3,14 @@
  * Krupa Sivakumaran, Aug 14 2013
  */
 
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
+#include "../kernel/bitmap.h"
 
 #define BLK_SIZE		4096
 #define INODE_SIZE		128
@@ -15,10 +19,27 @@
 #define INODE_TYPE_FILE		1
 #define INODE_TYPE_DIR		2
 
-#define ROUND_TO_BLK_SIZE(s)		(((s) + BLK_SIZE - 1) / BLK_SIZE * BLK_SIZE)
+#define BYTES_TO_BLKS(s)		(((s) + BLK_SIZE - 1) / BLK_SIZE)
+#define BLK_OFFSET(b)			((off_t)(b) * BLK_SIZE)
+
+/* block numbers in the inode block map are 31 bits, the top bit flags
+ * unwritten blocks. this caps the fs at 8 TB.
+ */
+#define MAX_BLOCKS			0x7fffffffLL
+
+#define BLOCKS_PER_GROUP	(BLK_SIZE * 8)
+#define INODES_PER_GROUP	(BLOCKS_PER_GROUP / 2)
 
 #define DENTRY_TYPE_DIR		2
 
+#define INODE_FLG_EXTENTS	0x2
+#define FEATURE_EXTENTS		0x1
+#define FEATURE_64BIT		0x2
+#define FEATURE_INLINE_DATA	0x4
+#define FEATURE_FILETYPE	0x8
+#define EXT_MAGIC		0x4a45
+#define EXT_INLINE		4
+
 struct super_block
 {
 	char name[16];
@@ -39,6 +60,22 @@ struct super_block
 
 	int next_free_block;
 	int next_free_inode;
+
+	int n_groups;
+	int gdt_start;
+	int gdt_size;
+
+	int orphan_head;
+
+	int features;
+};
+
+struct group_desc
+{
+	int n_blocks_free;
+	int n_inodes_free;
+	int next_free_block;
+	int next_free_inode;
 };
 
 struct disk_inode
@@ -50,40 +87,80 @@ struct disk_inode
 	int ver_meta_block;
 	int version_type;
 	int version_param;
-	char rsvd[44];
+	int next_orphan;
+	int flags;
+	int size_hi;
+	int dir_index;
+	int prev_orphan;
+	char rsvd[24];
+};
+
+struct extent_header
+{
+	unsigned short magic;
+	unsigned short entries;
+	unsigned short max;
+	unsigned short depth;
+};
+
+struct extent
+{
+	unsigned int logical;
+	unsigned int start;
+	unsigned int len;
 };
 
 struct dentry
 {
 	unsigned int inode;
-	char name[60];
+	char name[59];
+	unsigned char file_type;	/* INODE_TYPE_xxx */
 };
 
-int fill_super_block(struct super_block *sb, int disk_size)
+/* set by -e: new inodes map their blocks with extents */
+static int use_extents;
+
+/* the layout of the fs. all xxx_start and xxx_size fields are in
+ * blocks (FEATURE_64BIT), so that volumes can go past 2 GB.
+ */
+int fill_super_block(struct super_block *sb, off_t disk_size)
 {
-	int max_inodes, max_blks, metadata_size;
-	int data_bmap_size, inode_bmap_size, inode_tbl_size;
+	long long max_blks;
+	int max_inodes, metadata_blks, n_groups;
+	int gdt_size, data_bmap_size, inode_bmap_size, inode_tbl_size;
 
-	max_inodes = disk_size / 8192;
 	max_blks = disk_size / BLK_SIZE;
-	data_bmap_size = ROUND_TO_BLK_SIZE(max_blks / 8);
-	inode_bmap_size = ROUND_TO_BLK_SIZE(max_inodes / 8);
-	inode_tbl_size = ROUND_TO_BLK_SIZE(max_inodes * INODE_SIZE);
-
-	printf("disk size = %d\n", disk_size);
-	printf("max_blocks = %d, data_bmap_size = %d\n",
+	if (max_blks > MAX_BLOCKS) {
+		printf("only the first %lld GB of the disk are used\n",
+			MAX_BLOCKS * BLK_SIZE >> 30);
+		max_blks = MAX_BLOCKS;
+	}
+	max_inodes = max_blks / 2;
+	n_groups = (max_blks + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP;
+	gdt_size = BYTES_TO_BLKS((long long)n_groups * sizeof(struct group_desc));
+	data_bmap_size = BYTES_TO_BLKS((max_blks + 7) / 8);
+	inode_bmap_size = BYTES_TO_BLKS(((long long)max_inodes + 7) / 8);
+	inode_tbl_size = BYTES_TO_BLKS((long long)max_inodes * INODE_SIZE);
+
+	printf("disk size = %lld\n", (long long)disk_size);
+	printf("max_blocks = %lld, data_bmap_size = %d\n",
 		max_blks, data_bmap_size);
 	printf("max_inodes = %d, inode_bmap_size = %d, inode_tbl_size = %d\n",
 		max_inodes, inode_bmap_size, inode_tbl_size);
-
+	printf("groups = %d, gdt_size = %d\n", n_groups, gdt_size);
 
 	strcpy(sb->name, "jaguarfs");
 
 	sb->sb_start = 0;
-	sb->sb_size = BLK_SIZE;
+	sb->sb_size = 1;
 	printf("super block: start = %d, size = %d\n", sb->sb_start, sb->sb_size);
 
-	sb->data_bmap_start = sb->sb_start + sb->sb_size;
+	sb->n_groups = n_groups;
+	sb->gdt_start = sb->sb_start + sb->sb_size;
+	sb->gdt_size = gdt_size;
+	printf("group descriptors: start = %d, size = %d\n", sb->gdt_start, sb->gdt_size);
+
+	sb->data_bmap_start = sb->gdt_start + sb->gdt_size;
 	sb->data_bmap_size = data_bmap_size;
 	printf("data bitmap: start = %d, size = %d\n", sb->data_bmap_start, sb->data_bmap_size);
 
@@ -98,10 +175,11 @@ int fill_super_block(struct super_block *sb, int disk_size)
 	sb->data_start = sb->inode_tbl_start + sb->inode_tbl_size;
 	printf("data: start = %d\n", sb->data_start);
 
-	metadata_size = BLK_SIZE + data_bmap_size + inode_bmap_size + inode_tbl_size;
+	/* the first data block holds the dentries of the root dir */
+	metadata_blks = sb->data_start;
 	sb->n_blocks = max_blks;
-	sb->n_blocks_free = max_blks - (metadata_size / BLK_SIZE);
-	sb->next_free_block = metadata_size / BLK_SIZE;
+	sb->n_blocks_free = max_blks - metadata_blks - 1;
+	sb->next_free_block = metadata_blks + 1;
 	printf("blocks: total = %d, free = %d, next = %d\n", sb->n_blocks, sb->n_blocks_free, sb->next_free_block);
 
 	sb->n_inodes = max_inodes;
@@ -109,12 +187,18 @@ int fill_super_block(struct super_block *sb, int disk_size)
 	sb->next_free_inode = 2;
 	printf("inodes: total = %d, free = %d, next = %d\n", sb->n_inodes, sb->n_inodes_free, sb->next_free_inode);
 
+	sb->orphan_head = 0;
+
+	sb->features = FEATURE_64BIT | FEATURE_INLINE_DATA | FEATURE_FILETYPE |
+		(use_extents ? FEATURE_EXTENTS : 0);
+	printf("features = %#x\n", sb->features);
+
 	return 0;
 }
 
 int write_super_block(FILE *fp, struct super_block *sb)
 {
-	fseek(fp, sb->sb_start, SEEK_SET);
+	fseeko(fp, BLK_OFFSET(sb->sb_start), SEEK_SET);
 
 	if (fwrite(sb, sizeof(*sb), 1, fp) != 1)
 		return -1;
@@ -122,72 +206,103 @@ int write_super_block(FILE *fp, struct super_block *sb)
 	return 0;
 }
 
-void set_bit(unsigned char *buf, int pos)
+/* number of items in [lo, hi) that are below 'used' */
+static int count_used(int lo, int hi, int used)
 {
-	int index, offset;
-	unsigned char mask;
+	if (used <= lo)
+		return 0;
+	return (used < hi ? used : hi) - lo;
+}
 
-	index = pos / 8;
-	offset = pos % 8;
-	mask = 0x80 >> offset;
+/* end of the range of 'per_group' items of group 'g', out of 'total' */
+static int group_end(int g, int per_group, int total)
+{
+	long long hi = (long long)(g + 1) * per_group;
 
-	buf[index] |= mask;
+	return hi < total ? hi : total;
 }
 
-int write_data_bmap(FILE *fp, struct super_block *sb)
+int write_group_descs(FILE *fp, struct super_block *sb)
 {
-	unsigned char *data_bmap;
-	int i, n_fs_blks;
+	struct group_desc *gdt;
+	int g, lo, hi, used;
 
-	if ((data_bmap = malloc(sb->data_bmap_size)) == NULL) {
+	if ((gdt = malloc(sb->gdt_size * BLK_SIZE)) == NULL) {
 		errno = -ENOMEM;
 		return -1;
 	}
-	memset(data_bmap, 0, sb->data_bmap_size);
-
-	n_fs_blks = sb->data_start / BLK_SIZE;
-	printf("num filesystem metadata blocks = %d\n", n_fs_blks);
-
-	for (i = 0; i < n_fs_blks; i++)
-		set_bit(data_bmap, i);
-
-	/* the first data block is also reserved.
-	 * it holds the dentry for root dir.
-	 */
-	set_bit(data_bmap, n_fs_blks);
+	memset(gdt, 0, sb->gdt_size * BLK_SIZE);
+
+	for (g = 0; g < sb->n_groups; g++) {
+		/* blocks in use: all metadata, plus the root dir block */
+		lo = g * BLOCKS_PER_GROUP;
+		hi = group_end(g, BLOCKS_PER_GROUP, sb->n_blocks);
+		used = count_used(lo, hi, sb->next_free_block);
+		gdt[g].n_blocks_free = hi - lo - used;
+		gdt[g].next_free_block = used;
+
+		/* inodes in use: dummy inode 0 and root inode 1 */
+		lo = g * INODES_PER_GROUP;
+		hi = group_end(g, INODES_PER_GROUP, sb->n_inodes);
+		if (hi < lo)
+			hi = lo;
+		used = count_used(lo, hi, sb->next_free_inode);
+		gdt[g].n_inodes_free = hi - lo - used;
+		gdt[g].next_free_inode = used;
+	}
 
-	fseek(fp, sb->data_bmap_start, SEEK_SET);
-	if (fwrite(data_bmap, sb->data_bmap_size, 1, fp) != 1) {
-		free(data_bmap);
+	fseeko(fp, BLK_OFFSET(sb->gdt_start), SEEK_SET);
+	if (fwrite(gdt, sb->gdt_size * BLK_SIZE, 1, fp) != 1) {
+		free(gdt);
 		return -1;
 	}
 
-	free(data_bmap);
+	free(gdt);
 
 	return 0;
 }
 
-int write_inode_bmap(FILE *fp, struct super_block *sb)
+/* write the bitmap of 'size' blocks at block 'start', with its first
+ * 'n_used' bits set. it is written a block at a time, as the bitmaps
+ * of a multi-terabyte disk are too big to build in memory.
+ */
+static int write_bmap(FILE *fp, int start, int size, int n_used)
 {
-	unsigned char *inode_bmap;
-
-	if ((inode_bmap = malloc(sb->inode_bmap_size)) == NULL) {
-		errno = -ENOMEM;
-		return -1;
+	unsigned char buf[BLK_SIZE];
+	long long n;
+	int b;
+
+	fseeko(fp, BLK_OFFSET(start), SEEK_SET);
+	for (b = 0; b < size; b++) {
+		memset(buf, 0, BLK_SIZE);
+		n = n_used - (long long)b * BLK_SIZE * 8;
+		if (n > 0)
+			jaguar_set_bits(buf, 0, n < BLK_SIZE * 8 ? n : BLK_SIZE * 8);
+		if (fwrite(buf, BLK_SIZE, 1, fp) != 1)
+			return -1;
 	}
-	memset(inode_bmap, 0, sb->inode_bmap_size);
 
-	*inode_bmap |= 0xC0; // 0th inode is dummy, 1st inode is root inode
+	return 0;
+}
 
-	fseek(fp, sb->inode_bmap_start, SEEK_SET);
-	if (fwrite(inode_bmap, sb->inode_bmap_size, 1, fp) != 1) {
-		free(inode_bmap);
-		return -1;
-	}
+int write_data_bmap(FILE *fp, struct super_block *sb)
+{
+	int n_fs_blks;
 
-	free(inode_bmap);
+	n_fs_blks = sb->data_start;
+	printf("num filesystem metadata blocks = %d\n", n_fs_blks);
 
-	return 0;
+	/* the first data block is also reserved.
+	 * it holds the dentry for root dir.
+	 */
+	return write_bmap(fp, sb->data_bmap_start, sb->data_bmap_size,
+		n_fs_blks + 1);
+}
+
+int write_inode_bmap(FILE *fp, struct super_block *sb)
+{
+	/* 0th inode is dummy, 1st inode is root inode */
+	return write_bmap(fp, sb->inode_bmap_start, sb->inode_bmap_size, 2);
 }
 
 int write_inode_table(FILE *fp, struct super_block *sb)
@@ -198,12 +313,27 @@ int write_inode_table(FILE *fp, struct super_block *sb)
 	root_inode.size = sizeof(struct dentry) * 2; /* for . and .. */
 	root_inode.type = INODE_TYPE_DIR;
 	root_inode.nlink = 1;
-	root_inode.blocks[0] = sb->data_start / BLK_SIZE;
+
+	if (use_extents) {
+		/* a single extent for the dentry block */
+		struct extent_header *hdr = (struct extent_header *)root_inode.blocks;
+		struct extent *ex = (struct extent *)(hdr + 1);
+
+		hdr->magic = EXT_MAGIC;
+		hdr->entries = 1;
+		hdr->max = EXT_INLINE;
+		ex->logical = 0;
+		ex->start = sb->data_start;
+		ex->len = 1;
+		root_inode.flags = INODE_FLG_EXTENTS;
+	} else {
+		root_inode.blocks[0] = sb->data_start;
+	}
 
 	/* skip one disk inode, as there is no inode 0.
 	 * inum's only start with 1.
 	 */
-	fseek(fp, sb->inode_tbl_start + sizeof(root_inode), SEEK_SET);
+	fseeko(fp, BLK_OFFSET(sb->inode_tbl_start) + sizeof(root_inode), SEEK_SET);
 	if (fwrite(&root_inode, sizeof(root_inode), 1, fp) != 1) {
 		return -1;
 	}
@@ -223,12 +353,14 @@ int write_data(FILE *fp, struct super_block *sb)
 
 	/* write out a dentry for . and .. */
 	root_dentry->inode = 1; /* inum MUST start from 1 */
+	root_dentry->file_type = INODE_TYPE_DIR;
 	strcpy(root_dentry->name, ".");
 	root_dentry++;
 	root_dentry->inode = 1;
+	root_dentry->file_type = INODE_TYPE_DIR;
 	strcpy(root_dentry->name, "..");
 
-	fseek(fp, sb->data_start, SEEK_SET);
+	fseeko(fp, BLK_OFFSET(sb->data_start), SEEK_SET);
 	if (fwrite(blkbuf, BLK_SIZE, 1, fp) != 1) {
 		return -1;
 	}
@@ -240,24 +372,35 @@ int write_data(FILE *fp, struct super_block *sb)
 int main(int argc, char **argv)
 {
 	FILE *fp;
-	int ret = 0, disk_size;
+	int ret = 0, opt;
+	off_t disk_size;
 	struct super_block sb;
 
-	if (argc != 2) {
-		printf("Usage: mkfs.jaguar FILE\n");
-		ret = -EINVAL;
-		goto err;
+	while ((opt = getopt(argc, argv, "e")) != -1) {
+		switch (opt) {
+		case 'e':
+			use_extents = 1;
+			break;
+		default:
+			goto usage;
+		}
 	}
 
-	if ((fp = fopen(argv[1], "wb")) == NULL) {
+	if (optind != argc - 1)
+		goto usage;
+
+	/* "r+b", so that an image file is not truncated before its size
+	 * is taken.
+	 */
+	if ((fp = fopen(argv[optind], "r+b")) == NULL) {
 		perror(NULL);
 		ret = errno;
 		goto err;
 	}
 
-	fseek(fp, 0, SEEK_END);
-	disk_size = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
+	fseeko(fp, 0, SEEK_END);
+	disk_size = ftello(fp);
+	fseeko(fp, 0, SEEK_SET);
 
 	fill_super_block(&sb, disk_size);
 
@@ -269,6 +412,14 @@ int main(int argc, char **argv)
 	}
 	printf("[ok]\n");
 
+	printf("writing group descriptors...");
+	if (write_group_descs(fp, &sb) < 0) {
+		perror(NULL);
+		ret = errno;
+		goto fail;
+	}
+	printf("[ok]\n");
+
 	printf("writing data bitmap...");
 	if (write_data_bmap(fp, &sb) < 0) {
 		perror(NULL);
@@ -306,6 +457,11 @@ int main(int argc, char **argv)
 
 	return 0;
 
+usage:
+	printf("Usage: mkfs.jaguar [-e] FILE\n");
+	printf("  -e    map file blocks with extents\n");
+	return -EINVAL;
+
 fail:
 	printf("[failed]\n");
 	fclose(fp);